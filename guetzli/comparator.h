@@ -0,0 +1,62 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GUETZLI_COMPARATOR_H_
+#define GUETZLI_COMPARATOR_H_
+
+#include <vector>
+
+#include "guetzli/output_image.h"
+
+namespace guetzli {
+
+// Represents a perceptual distance between an original image and output
+// images that are compared to it.
+class Comparator {
+ public:
+  virtual ~Comparator() {}
+
+  // Compares img with the original image and updates the distance map and
+  // the distance.
+  virtual void Compare(const OutputImage& img) = 0;
+
+  // Same as Compare(), but may reuse the results of the previous comparison
+  // for the parts of the image that are not among img->DirtyBlocks(). Clears
+  // the dirty blocks of img. The previously compared image must have been
+  // *img, or the blocks in which it differed from *img must be dirty.
+  virtual void CompareDirty(OutputImage* img) {
+    Compare(*img);
+    img->ClearDirtyBlocks();
+  }
+
+  // Returns the distance of the last compared image from the original, 0.0
+  // for identical images.
+  virtual double distance() const = 0;
+
+  // Returns the distances of the 8x8 pixel blocks of the last compared image,
+  // in row-major order of the blocks.
+  virtual const std::vector<float>& distmap() const = 0;
+
+  // Returns true if the distance of the last compared image is at most
+  // target_distance.
+  bool DistanceOK(double target_distance) const {
+    return distance() <= target_distance;
+  }
+};
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_COMPARATOR_H_
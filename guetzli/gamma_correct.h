@@ -17,10 +17,40 @@
 #ifndef GUETZLI_GAMMA_CORRECT_H_
 #define GUETZLI_GAMMA_CORRECT_H_
 
+#include <stdint.h>
+
 namespace guetzli {
 
 const double* Srgb8ToLinearTable();
 
+// Same as Srgb8ToLinearTable(), in single precision.
+const float* Srgb8ToLinearFloatTable();
+
+// Returns x ** exponent for x >= 0, computed as exp2(exponent * log2(x)) with
+// polynomial approximations. For results in the normal float range the
+// relative error is below 2e-7 * (1 + |exponent * log2(x)|), i.e. below 2e-6
+// for the gamma conversions below. Returns 0 if x or the result is smaller
+// than the smallest normal float.
+float FastPow(float x, float exponent);
+
+// Sets out[i] = out_scale * FastPow(in_scale * in[i], exponent) for the n
+// values of in[], several values at a time. in and out may be the same.
+void FastPowRow(const float* in, int n, float in_scale, float exponent,
+                float out_scale, float* out);
+
+// The simple power 2.2 gamma, with gamma encoded values in range 0.0-255.0
+// and linear values in range 0.0-1.0.
+
+// Table of the linear values of the 8-bit gamma encoded values.
+const float* Gamma8ToLinearTable();
+
+// Converts n gamma encoded values to linear values. in and out may be the same.
+void GammaToLinearRow(const float* in, int n, float* out);
+
+// Converts n linear values to gamma encoded values. in and out may be the
+// same.
+void LinearToGammaRow(const float* in, int n, float* out);
+
 }  // namespace guetzli
 
 #endif  // GUETZLI_GAMMA_CORRECT_H_
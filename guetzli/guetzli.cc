@@ -15,18 +15,42 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <exception>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
 #include "png.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
 #include "guetzli/jpeg_data.h"
+#include "guetzli/jpeg_data_encoder.h"
 #include "guetzli/jpeg_data_reader.h"
+#include "guetzli/jpeg_data_writer.h"
 #include "guetzli/processor.h"
+#include "guetzli/quality.h"
+#include "guetzli/result_cache.h"
 #include "guetzli/stats.h"
+#include "guetzli/thread_pool.h"
 
 namespace {
 
@@ -39,12 +63,115 @@ constexpr int kLowestMemusageMB = 100; // in MB
 
 constexpr int kDefaultMemlimitMB = 6000; // in MB
 
+constexpr int kDefaultCacheSizeMB = 1024; // in MB
+
 inline uint8_t BlendOnBlack(const uint8_t val, const uint8_t alpha) {
   return (static_cast<int>(val) * static_cast<int>(alpha) + 128) / 255;
 }
 
-bool ReadPNG(const std::string& data, int* xsize, int* ysize,
-             std::vector<uint8_t>* rgb) {
+#ifdef __SSE2__
+// BlendOnBlack() of the 16 channel values in v, whose alpha values are every
+// second (num_channels == 2) or fourth (num_channels == 4) value.
+inline __m128i BlendOnBlack16(__m128i v, int num_channels) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi16(128);
+  // (x * 0x8081) >> 23 == x / 255 for x <= 255 * 255 + 128.
+  const __m128i div255 = _mm_set1_epi16(static_cast<short>(0x8081));
+  __m128i halves[2] = { _mm_unpacklo_epi8(v, zero),
+                        _mm_unpackhi_epi8(v, zero) };
+  for (__m128i& x : halves) {
+    __m128i alpha;
+    if (num_channels == 4) {
+      alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xff), 0xff);
+    } else {
+      alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xf5), 0xf5);
+    }
+    x = _mm_add_epi16(_mm_mullo_epi16(x, alpha), round);
+    x = _mm_srli_epi16(_mm_mulhi_epu16(x, div255), 7);
+  }
+  return _mm_packus_epi16(halves[0], halves[1]);
+}
+#endif  // __SSE2__
+
+// Converts a row of xsize pixels with num_channels 8-bit channels (gray, gray
+// + alpha, RGB or RGBA) to RGB, blending the alpha on black.
+void ConvertRowToRGB(const uint8_t* row_in, int num_channels, int xsize,
+                     uint8_t* row_out) {
+  int x = 0;
+  switch (num_channels) {
+    case 1:
+      for (; x < xsize; ++x) {
+        const uint8_t gray = row_in[x];
+        row_out[3 * x + 0] = gray;
+        row_out[3 * x + 1] = gray;
+        row_out[3 * x + 2] = gray;
+      }
+      break;
+    case 2:
+#ifdef __SSE2__
+      for (; x + 8 <= xsize; x += 8) {
+        alignas(16) uint8_t blended[16];
+        _mm_store_si128(reinterpret_cast<__m128i*>(blended), BlendOnBlack16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(&row_in[2 * x])),
+            2));
+        for (int i = 0; i < 8; ++i) {
+          row_out[3 * (x + i) + 0] = blended[2 * i];
+          row_out[3 * (x + i) + 1] = blended[2 * i];
+          row_out[3 * (x + i) + 2] = blended[2 * i];
+        }
+      }
+#endif  // __SSE2__
+      for (; x < xsize; ++x) {
+        const uint8_t gray = BlendOnBlack(row_in[2 * x], row_in[2 * x + 1]);
+        row_out[3 * x + 0] = gray;
+        row_out[3 * x + 1] = gray;
+        row_out[3 * x + 2] = gray;
+      }
+      break;
+    case 3:
+      memcpy(row_out, row_in, 3 * xsize);
+      break;
+    case 4:
+#ifdef __SSE2__
+      for (; x + 4 <= xsize; x += 4) {
+        alignas(16) uint8_t blended[16];
+        _mm_store_si128(reinterpret_cast<__m128i*>(blended), BlendOnBlack16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(&row_in[4 * x])),
+            4));
+        for (int i = 0; i < 4; ++i) {
+          row_out[3 * (x + i) + 0] = blended[4 * i + 0];
+          row_out[3 * (x + i) + 1] = blended[4 * i + 1];
+          row_out[3 * (x + i) + 2] = blended[4 * i + 2];
+        }
+      }
+#endif  // __SSE2__
+      for (; x < xsize; ++x) {
+        const uint8_t alpha = row_in[4 * x + 3];
+        row_out[3 * x + 0] = BlendOnBlack(row_in[4 * x + 0], alpha);
+        row_out[3 * x + 1] = BlendOnBlack(row_in[4 * x + 1], alpha);
+        row_out[3 * x + 2] = BlendOnBlack(row_in[4 * x + 2], alpha);
+      }
+      break;
+  }
+}
+
+// The state of ReadPNG() that has to survive a png_error() longjmp.
+struct PNGReadState {
+  const uint8_t* next_byte;
+  size_t bytes_left;
+  std::vector<uint8_t> row;
+  std::vector<uint8_t> image;
+  std::vector<png_bytep> row_pointers;
+};
+
+// Decodes the PNG in data to 8-bit RGB, with the alpha blended on black.
+// Calls admit() with the image size as soon as the header has been read, and
+// fails before allocating the image if it returns false. The rows are
+// converted to RGB one by one as they are decoded; only interlaced images are
+// first decoded as a whole.
+bool ReadPNG(const std::string& data,
+             const std::function<bool(int, int)>& admit,
+             int* xsize, int* ysize, std::vector<uint8_t>* rgb) {
   png_structp png_ptr =
       png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
   if (!png_ptr) {
@@ -57,152 +184,941 @@ bool ReadPNG(const std::string& data, int* xsize, int* ysize,
     return false;
   }
 
+  PNGReadState state;
+  state.next_byte = reinterpret_cast<const uint8_t*>(data.data());
+  state.bytes_left = data.size();
+
   if (setjmp(png_jmpbuf(png_ptr)) != 0) {
     // Ok we are here because of the setjmp.
     png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
     return false;
   }
 
-  std::istringstream memstream(data, std::ios::in | std::ios::binary);
-  png_set_read_fn(png_ptr, static_cast<void*>(&memstream), [](png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead) {
-    std::istringstream& memstream = *static_cast<std::istringstream*>(png_get_io_ptr(png_ptr));
-    
-    memstream.read(reinterpret_cast<char*>(outBytes), byteCountToRead);
-
-    if (memstream.eof()) png_error(png_ptr, "unexpected end of data");
-    if (memstream.fail()) png_error(png_ptr, "read from memory error");
+  png_set_read_fn(png_ptr, &state, [](png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead) {
+    PNGReadState* state = static_cast<PNGReadState*>(png_get_io_ptr(png_ptr));
+    if (byteCountToRead > state->bytes_left) {
+      png_error(png_ptr, "unexpected end of data");
+    }
+    memcpy(outBytes, state->next_byte, byteCountToRead);
+    state->next_byte += byteCountToRead;
+    state->bytes_left -= byteCountToRead;
   });
 
-  // The png_transforms flags are as follows:
+  png_read_info(png_ptr, info_ptr);
+  *xsize = png_get_image_width(png_ptr, info_ptr);
+  *ysize = png_get_image_height(png_ptr, info_ptr);
+  if (!admit(*xsize, *ysize)) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+    return false;
+  }
+
+  // The same transforms as PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND |
+  // PNG_TRANSFORM_STRIP_16 of png_read_png():
   // packing == convert 1,2,4 bit images,
-  // strip == 16 -> 8 bits / channel,
-  // shift == use sBIT dynamics, and
+  // strip == 16 -> 8 bits / channel, and
   // expand == palettes -> rgb, grayscale -> 8 bit images, tRNS -> alpha.
-  const unsigned int png_transforms =
-      PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND | PNG_TRANSFORM_STRIP_16;
+  png_set_packing(png_ptr);
+  png_set_expand(png_ptr);
+  png_set_strip_16(png_ptr);
+  const int num_passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  const int components = png_get_channels(png_ptr, info_ptr);
+  if (components < 1 || components > 4) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+    return false;
+  }
+  const size_t row_bytes = png_get_rowbytes(png_ptr, info_ptr);
+  rgb->resize(3 * static_cast<size_t>(*xsize) * (*ysize));
+  if (num_passes == 1) {
+    state.row.resize(row_bytes);
+    for (int y = 0; y < *ysize; ++y) {
+      png_read_row(png_ptr, &state.row[0], nullptr);
+      ConvertRowToRGB(&state.row[0], components, *xsize,
+                      &(*rgb)[3 * y * static_cast<size_t>(*xsize)]);
+    }
+  } else {
+    // The rows of an interlaced image are only complete after the last pass.
+    state.image.resize(row_bytes * (*ysize));
+    state.row_pointers.resize(*ysize);
+    for (int y = 0; y < *ysize; ++y) {
+      state.row_pointers[y] = &state.image[y * row_bytes];
+    }
+    png_read_image(png_ptr, &state.row_pointers[0]);
+    for (int y = 0; y < *ysize; ++y) {
+      ConvertRowToRGB(state.row_pointers[y], components, *xsize,
+                      &(*rgb)[3 * y * static_cast<size_t>(*xsize)]);
+    }
+  }
+  png_read_end(png_ptr, info_ptr);
+  png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+  return true;
+}
 
-  png_read_png(png_ptr, info_ptr, png_transforms, nullptr);
+bool IsPNG(const std::string& data) {
+  static const unsigned char kPNGMagicBytes[] = {
+      0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+  };
+  return (data.size() >= 8 &&
+          memcmp(data.data(), kPNGMagicBytes, sizeof(kPNGMagicBytes)) == 0);
+}
 
-  png_bytep* row_pointers = png_get_rows(png_ptr, info_ptr);
+// Returns true if data starts like a binary PGM (P5), PPM (P6) or PAM (P7)
+// image.
+bool IsPNM(const std::string& data) {
+  return (data.size() >= 3 && data[0] == 'P' &&
+          (data[1] == '5' || data[1] == '6' || data[1] == '7') &&
+          isspace(static_cast<unsigned char>(data[2])));
+}
 
-  *xsize = png_get_image_width(png_ptr, info_ptr);
-  *ysize = png_get_image_height(png_ptr, info_ptr);
-  rgb->resize(3 * (*xsize) * (*ysize));
+// The header fields of a PGM, PPM or PAM image.
+struct PNMHeader {
+  int xsize = 0;
+  int ysize = 0;
+  int num_channels = 0;
+  int maxval = 0;
+  // The offset of the first sample in the file.
+  size_t data_offset = 0;
+};
 
-  const int components = png_get_channels(png_ptr, info_ptr);
-  switch (components) {
-    case 1: {
-      // GRAYSCALE
-      for (int y = 0; y < *ysize; ++y) {
-        const uint8_t* row_in = row_pointers[y];
-        uint8_t* row_out = &(*rgb)[3 * y * (*xsize)];
-        for (int x = 0; x < *xsize; ++x) {
-          const uint8_t gray = row_in[x];
-          row_out[3 * x + 0] = gray;
-          row_out[3 * x + 1] = gray;
-          row_out[3 * x + 2] = gray;
-        }
-      }
+// Skips the whitespace and the comments, which run from '#' to the end of
+// the line, starting at *pos.
+void SkipPNMWhitespace(const std::string& data, size_t* pos) {
+  while (*pos < data.size()) {
+    if (data[*pos] == '#') {
+      while (*pos < data.size() && data[*pos] != '\n') ++(*pos);
+    } else if (isspace(static_cast<unsigned char>(data[*pos]))) {
+      ++(*pos);
+    } else {
       break;
     }
-    case 2: {
-      // GRAYSCALE + ALPHA
-      for (int y = 0; y < *ysize; ++y) {
-        const uint8_t* row_in = row_pointers[y];
-        uint8_t* row_out = &(*rgb)[3 * y * (*xsize)];
-        for (int x = 0; x < *xsize; ++x) {
-          const uint8_t gray = BlendOnBlack(row_in[2 * x], row_in[2 * x + 1]);
-          row_out[3 * x + 0] = gray;
-          row_out[3 * x + 1] = gray;
-          row_out[3 * x + 2] = gray;
-        }
+  }
+}
+
+// Reads the decimal number at *pos into *value, after skipping whitespace
+// and comments. Fails for values above 1 << 30.
+bool ReadPNMNumber(const std::string& data, size_t* pos, int* value) {
+  SkipPNMWhitespace(data, pos);
+  if (*pos >= data.size() ||
+      !isdigit(static_cast<unsigned char>(data[*pos]))) {
+    return false;
+  }
+  int64_t v = 0;
+  while (*pos < data.size() &&
+         isdigit(static_cast<unsigned char>(data[*pos]))) {
+    v = 10 * v + (data[(*pos)++] - '0');
+    if (v > (1 << 30)) return false;
+  }
+  *value = static_cast<int>(v);
+  return true;
+}
+
+// Reads the whitespace separated word at *pos into *word, after skipping
+// whitespace and comments.
+void ReadPNMWord(const std::string& data, size_t* pos, std::string* word) {
+  SkipPNMWhitespace(data, pos);
+  const size_t start = *pos;
+  while (*pos < data.size() &&
+         !isspace(static_cast<unsigned char>(data[*pos]))) {
+    ++(*pos);
+  }
+  word->assign(data, start, *pos - start);
+}
+
+// Parses the header of the PGM, PPM or PAM image in data, and checks that
+// data holds all the samples.
+bool ReadPNMHeader(const std::string& data, PNMHeader* header) {
+  if (!IsPNM(data)) {
+    return false;
+  }
+  size_t pos = 2;
+  if (data[1] == '7') {
+    // The PAM header is a list of "NAME value" lines up to ENDHDR.
+    std::string word;
+    for (;;) {
+      ReadPNMWord(data, &pos, &word);
+      if (word == "ENDHDR") {
+        break;
+      } else if (word == "WIDTH") {
+        if (!ReadPNMNumber(data, &pos, &header->xsize)) return false;
+      } else if (word == "HEIGHT") {
+        if (!ReadPNMNumber(data, &pos, &header->ysize)) return false;
+      } else if (word == "DEPTH") {
+        if (!ReadPNMNumber(data, &pos, &header->num_channels)) return false;
+      } else if (word == "MAXVAL") {
+        if (!ReadPNMNumber(data, &pos, &header->maxval)) return false;
+      } else if (word == "TUPLTYPE") {
+        // The tuple type follows from DEPTH.
+        while (pos < data.size() && data[pos] != '\n') ++pos;
+      } else {
+        return false;
       }
-      break;
     }
-    case 3: {
-      // RGB
-      for (int y = 0; y < *ysize; ++y) {
-        const uint8_t* row_in = row_pointers[y];
-        uint8_t* row_out = &(*rgb)[3 * y * (*xsize)];
-        memcpy(row_out, row_in, 3 * (*xsize));
-      }
-      break;
+    if (pos >= data.size() || data[pos] != '\n') {
+      return false;
+    }
+  } else {
+    header->num_channels = data[1] == '5' ? 1 : 3;
+    if (!ReadPNMNumber(data, &pos, &header->xsize) ||
+        !ReadPNMNumber(data, &pos, &header->ysize) ||
+        !ReadPNMNumber(data, &pos, &header->maxval) ||
+        pos >= data.size() || !isspace(static_cast<unsigned char>(data[pos]))) {
+      return false;
     }
-    case 4: {
-      // RGBA
-      for (int y = 0; y < *ysize; ++y) {
-        const uint8_t* row_in = row_pointers[y];
-        uint8_t* row_out = &(*rgb)[3 * y * (*xsize)];
-        for (int x = 0; x < *xsize; ++x) {
-          const uint8_t alpha = row_in[4 * x + 3];
-          row_out[3 * x + 0] = BlendOnBlack(row_in[4 * x + 0], alpha);
-          row_out[3 * x + 1] = BlendOnBlack(row_in[4 * x + 1], alpha);
-          row_out[3 * x + 2] = BlendOnBlack(row_in[4 * x + 2], alpha);
+  }
+  // A single whitespace character separates the header from the samples.
+  header->data_offset = pos + 1;
+  if (header->xsize <= 0 || header->ysize <= 0 ||
+      header->num_channels < 1 || header->num_channels > 4 ||
+      header->maxval < 1 || header->maxval > 65535) {
+    return false;
+  }
+  const size_t bytes_per_sample = header->maxval > 255 ? 2 : 1;
+  const size_t data_size = static_cast<size_t>(header->xsize) *
+      header->ysize * header->num_channels * bytes_per_sample;
+  return data.size() - header->data_offset >= data_size;
+}
+
+// Decodes the PGM, PPM or PAM image in data to 8-bit RGB, with the alpha of
+// the gray + alpha and RGBA PAM tuple types blended on black like in
+// ReadPNG(). Calls admit() with the image size before allocating the image,
+// and fails if it returns false.
+bool ReadPNM(const std::string& data,
+             const std::function<bool(int, int)>& admit,
+             int* xsize, int* ysize, std::vector<uint8_t>* rgb) {
+  PNMHeader header;
+  if (!ReadPNMHeader(data, &header) || !admit(header.xsize, header.ysize)) {
+    return false;
+  }
+  *xsize = header.xsize;
+  *ysize = header.ysize;
+  rgb->resize(3 * static_cast<size_t>(header.xsize) * header.ysize);
+  const int row_samples = header.xsize * header.num_channels;
+  const uint8_t* in =
+      reinterpret_cast<const uint8_t*>(data.data()) + header.data_offset;
+  std::vector<uint8_t> row(row_samples);
+  for (int y = 0; y < header.ysize; ++y) {
+    const uint8_t* row_in = in;
+    if (header.maxval > 255) {
+      for (int i = 0; i < row_samples; ++i) {
+        const int v = std::min((in[2 * i] << 8) | in[2 * i + 1], header.maxval);
+        row[i] = (255 * v + header.maxval / 2) / header.maxval;
+      }
+      in += 2 * row_samples;
+      row_in = row.data();
+    } else {
+      if (header.maxval < 255) {
+        for (int i = 0; i < row_samples; ++i) {
+          const int v = std::min<int>(in[i], header.maxval);
+          row[i] = (255 * v + header.maxval / 2) / header.maxval;
         }
+        row_in = row.data();
       }
-      break;
+      in += row_samples;
     }
-    default:
-      png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+    ConvertRowToRGB(row_in, header.num_channels, header.xsize,
+                    &(*rgb)[3 * static_cast<size_t>(y) * header.xsize]);
+  }
+  return true;
+}
+
+// Reads the image dimensions from the PNG, PNM or JPEG header in data,
+// without decoding the image.
+bool ReadImageSize(const std::string& data, int* xsize, int* ysize) {
+  if (IsPNM(data)) {
+    PNMHeader header;
+    if (!ReadPNMHeader(data, &header)) {
       return false;
+    }
+    *xsize = header.xsize;
+    *ysize = header.ysize;
+    return true;
   }
-  png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+  if (IsPNG(data)) {
+    // The IHDR chunk comes first, with the big-endian width and height.
+    static const char kIHDR[] = "IHDR";
+    if (data.size() < 24 || memcmp(&data[12], kIHDR, 4) != 0) {
+      return false;
+    }
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&data[16]);
+    const uint32_t w = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    const uint32_t h = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+    if (w == 0 || h == 0 || w > 0x7fffffff || h > 0x7fffffff) {
+      return false;
+    }
+    *xsize = w;
+    *ysize = h;
+    return true;
+  }
+  guetzli::JPEGData jpg_header;
+  if (!guetzli::ReadJpeg(data, guetzli::JPEG_READ_HEADER, &jpg_header)) {
+    return false;
+  }
+  *xsize = jpg_header.width;
+  *ysize = jpg_header.height;
   return true;
 }
 
-std::string ReadFileOrDie(const char* filename) {
+bool ReadFile(const char* filename, std::string* result) {
   bool read_from_stdin = strncmp(filename, "-", 2) == 0;
 
   FILE* f = read_from_stdin ? stdin : fopen(filename, "rb");
   if (!f) {
     perror("Can't open input file");
-    exit(1);
+    return false;
   }
 
-  std::string result;
   off_t buffer_size = 8192;
 
   if (fseek(f, 0, SEEK_END) == 0) {
     buffer_size = std::max<off_t>(ftell(f), 1);
     if (fseek(f, 0, SEEK_SET) != 0) {
       perror("fseek");
-      exit(1);
+      fclose(f);
+      return false;
     }
   } else if (ferror(f)) {
     perror("fseek");
-    exit(1);
+    fclose(f);
+    return false;
   }
 
+  result->clear();
   std::unique_ptr<char[]> buf(new char[buffer_size]);
   while (!feof(f)) {
     size_t read_bytes = fread(buf.get(), sizeof(char), buffer_size, f);
     if (ferror(f)) {
       perror("fread");
-      exit(1);
+      fclose(f);
+      return false;
     }
-    result.append(buf.get(), read_bytes);
+    result->append(buf.get(), read_bytes);
   }
 
   fclose(f);
+  return true;
+}
+
+std::string ReadFileOrDie(const char* filename) {
+  std::string result;
+  if (!ReadFile(filename, &result)) {
+    exit(1);
+  }
   return result;
 }
 
-void WriteFileOrDie(const char* filename, const std::string& contents) {
+bool WriteFile(const char* filename, const std::string& contents) {
   bool write_to_stdout = strncmp(filename, "-", 2) == 0;
 
   FILE* f = write_to_stdout ? stdout : fopen(filename, "wb");
   if (!f) {
     perror("Can't open output file for writing");
-    exit(1);
+    return false;
   }
   if (fwrite(contents.data(), 1, contents.size(), f) != contents.size()) {
     perror("fwrite");
-    exit(1);
+    fclose(f);
+    return false;
   }
   if (fclose(f) < 0) {
     perror("fclose");
-    exit(1);
+    return false;
+  }
+  return true;
+}
+
+int FileOut(void* data, const uint8_t* buf, size_t count) {
+  return fwrite(buf, 1, count, reinterpret_cast<FILE*>(data));
+}
+
+int StringOut(void* data, const uint8_t* buf, size_t count) {
+  reinterpret_cast<std::string*>(data)->append(
+      reinterpret_cast<const char*>(buf), count);
+  return count;
+}
+
+// The headerless input formats.
+enum RawFormat {
+  kRawNone,
+  kRawRGB,
+  kRawYUV444,
+  kRawYUV420,
+};
+
+// The settings that apply to every input file.
+struct Options {
+  guetzli::Params params;
+  int quality = kDefaultJPEGQuality;
+  int memlimit_mb = kDefaultMemlimitMB;
+  bool optimize = false;
+  bool requantize = false;
+  // May be null.
+  guetzli::ResultCache* cache = nullptr;
+  // Unless raw_format is kRawNone, every input is a headerless image of
+  // raw_xsize x raw_ysize pixels instead of a PNG, PNM or JPEG file.
+  RawFormat raw_format = kRawNone;
+  int raw_xsize = 0;
+  int raw_ysize = 0;
+};
+
+// Returns the expected size of the raw input files in bytes.
+size_t RawImageSize(const Options& opts) {
+  if (opts.raw_format == kRawRGB) {
+    return 3 * static_cast<size_t>(opts.raw_xsize) * opts.raw_ysize;
+  }
+  return guetzli::YUVImageSize(opts.raw_xsize, opts.raw_ysize,
+                               opts.raw_format == kRawYUV420);
+}
+
+// Returns a string that tells raw inputs of different formats or sizes apart
+// in the result cache, or "" for other inputs.
+std::string RawFormatKey(const Options& opts) {
+  static const char* const kNames[] = { "", "rgb", "yuv444", "yuv420" };
+  if (opts.raw_format == kRawNone) {
+    return std::string();
+  }
+  return (std::string(kNames[opts.raw_format]) + ":" +
+          std::to_string(opts.raw_xsize) + "x" +
+          std::to_string(opts.raw_ysize));
+}
+
+bool IsJPEGInput(const Options& opts, const std::string& data) {
+  return opts.raw_format == kRawNone && !IsPNG(data) && !IsPNM(data);
+}
+
+// Same as ReadImageSize(), but also for raw inputs.
+bool ReadInputSize(const Options& opts, const std::string& data,
+                   int* xsize, int* ysize) {
+  if (opts.raw_format != kRawNone) {
+    *xsize = opts.raw_xsize;
+    *ysize = opts.raw_ysize;
+    return true;
+  }
+  return ReadImageSize(data, xsize, ysize);
+}
+
+// Returns the estimated memory use of compressing an image of the given
+// size, in bytes.
+double MemoryUse(int xsize, int ysize) {
+  return static_cast<double>(xsize) * ysize * kBytesPerPixel;
+}
+
+bool MemoryLimitExceeded(const Options& opts, int xsize, int ysize) {
+  return (opts.memlimit_mb != -1 &&
+          (MemoryUse(xsize, ysize) / (1 << 20) > opts.memlimit_mb ||
+           opts.memlimit_mb < kLowestMemusageMB));
+}
+
+// Checks that in_data has a JPEG header and that the image fits in the
+// memory limit. Prints an error message otherwise.
+bool CheckJpegInput(const Options& opts, const std::string& in_data) {
+  guetzli::JPEGData jpg_header;
+  if (!guetzli::ReadJpeg(in_data, guetzli::JPEG_READ_HEADER, &jpg_header)) {
+    fprintf(stderr, "Error reading JPG data from input file\n");
+    return false;
+  }
+  if (MemoryLimitExceeded(opts, jpg_header.width, jpg_header.height)) {
+    fprintf(stderr, "Memory limit would be exceeded. Failing.\n");
+    return false;
+  }
+  return true;
+}
+
+// Streams the losslessly optimized jpeg in in_data to out, requantized to
+// the --quality first with --requantize.
+bool Optimize(const Options& opts, guetzli::ProcessStats* stats,
+              const std::string& in_data, guetzli::JPEGOutput out) {
+  bool ok = opts.requantize ?
+      guetzli::RequantizeJpeg(opts.params, stats, in_data, opts.quality, 0.0f,
+                              out) :
+      guetzli::OptimizeJpeg(opts.params, stats, in_data, out);
+  if (!ok) {
+    fprintf(stderr, "Guetzli optimization failed\n");
+  }
+  return ok;
+}
+
+// Decodes the raw RGB, PNG or PNM image in in_data to 8-bit RGB, or copies
+// the raw YCbCr image in in_data to *pixels. Prints an error message and
+// returns false on failure, or if the image does not fit in the memory limit.
+bool ReadPixels(const Options& opts, const std::string& in_data,
+                int* xsize, int* ysize, std::vector<uint8_t>* pixels) {
+  bool rejected = false;
+  auto admit = [&opts, &rejected](int xsize, int ysize) {
+    rejected = MemoryLimitExceeded(opts, xsize, ysize);
+    return !rejected;
+  };
+  const char* format;
+  bool ok;
+  if (opts.raw_format != kRawNone) {
+    format = "raw";
+    *xsize = opts.raw_xsize;
+    *ysize = opts.raw_ysize;
+    ok = in_data.size() == RawImageSize(opts) && admit(*xsize, *ysize);
+    if (ok) {
+      pixels->assign(in_data.begin(), in_data.end());
+    }
+  } else if (IsPNM(in_data)) {
+    format = "PNM";
+    ok = ReadPNM(in_data, admit, xsize, ysize, pixels);
+  } else {
+    format = "PNG";
+    ok = ReadPNG(in_data, admit, xsize, ysize, pixels);
+  }
+  if (!ok) {
+    if (rejected) {
+      fprintf(stderr, "Memory limit would be exceeded. Failing.\n");
+    } else {
+      fprintf(stderr, "Error reading %s data from input file\n", format);
+    }
+  }
+  return ok;
+}
+
+// Compresses the PNG, PNM, raw or JPEG image in in_data to *out_data. Prints
+// an error message and returns false on failure.
+bool Compress(const Options& opts, guetzli::ProcessStats* stats,
+              const std::string& in_data, std::string* out_data) {
+  const guetzli::Params& params = opts.params;
+  out_data->clear();
+  // The cache is checked before any decoding. --optimize is not cached, since
+  // it takes about as long as reading the cached result.
+  uint64_t cache_key = 0;
+  if (opts.cache && !opts.optimize) {
+    cache_key = guetzli::ResultCache::Key(params, in_data, RawFormatKey(opts));
+    if (opts.cache->Lookup(cache_key, stats, out_data)) {
+      return true;
+    }
+  }
+
+  if (!IsJPEGInput(opts, in_data)) {
+    if (opts.optimize) {
+      fprintf(stderr, "--optimize and --requantize require a JPEG input "
+              "file\n");
+      return false;
+    }
+    int xsize, ysize;
+    std::vector<uint8_t> pixels;
+    if (!ReadPixels(opts, in_data, &xsize, &ysize, &pixels)) {
+      return false;
+    }
+    const bool ok =
+        opts.raw_format == kRawYUV444 || opts.raw_format == kRawYUV420 ?
+        guetzli::ProcessYUV(params, stats, pixels, xsize, ysize,
+                            opts.raw_format == kRawYUV420, out_data) :
+        guetzli::Process(params, stats, pixels, xsize, ysize, out_data);
+    if (!ok) {
+      fprintf(stderr, "Guetzli processing failed\n");
+      return false;
+    }
+  } else {
+    if (!CheckJpegInput(opts, in_data)) {
+      return false;
+    }
+    if (opts.optimize) {
+      return Optimize(opts, stats, in_data,
+                      guetzli::JPEGOutput(StringOut, out_data));
+    }
+    if (!guetzli::Process(params, stats, in_data, out_data)) {
+      fprintf(stderr, "Guetzli processing failed\n");
+      return false;
+    }
+  }
+
+  if (opts.cache && !opts.cache->Store(cache_key, *out_data)) {
+    fprintf(stderr, "Failed to add the result to the cache\n");
+  }
+  return true;
+}
+
+// Same as Compress(), but writes the output to out_filename and sets
+// *out_size to its size. The --optimize output is streamed to the file.
+bool CompressFile(const Options& opts, guetzli::ProcessStats* stats,
+                  const std::string& in_data, const char* out_filename,
+                  size_t* out_size) {
+  if (opts.optimize && IsJPEGInput(opts, in_data)) {
+    if (!CheckJpegInput(opts, in_data)) {
+      return false;
+    }
+    bool write_to_stdout = strncmp(out_filename, "-", 2) == 0;
+    FILE* f = write_to_stdout ? stdout : fopen(out_filename, "wb");
+    if (!f) {
+      perror("Can't open output file for writing");
+      return false;
+    }
+    bool ok = Optimize(opts, stats, in_data, guetzli::JPEGOutput(FileOut, f));
+    if (fclose(f) < 0) {
+      perror("fclose");
+      ok = false;
+    }
+    if (!ok) {
+      // Do not leave a truncated jpeg behind.
+      if (!write_to_stdout) {
+        remove(out_filename);
+      }
+      return false;
+    }
+    *out_size = stats->counters[guetzli::kOutputSizeCnt];
+    return true;
+  }
+  std::string out_data;
+  if (!Compress(opts, stats, in_data, &out_data)) {
+    return false;
+  }
+  *out_size = out_data.size();
+  return WriteFile(out_filename, out_data);
+}
+
+// Blocks the callers of Acquire() while the estimated memory use of the
+// images in flight would exceed the limit.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(double limit) : available_(limit) {}
+
+  void Acquire(double bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this, bytes] { return bytes <= available_; });
+    available_ -= bytes;
+  }
+
+  void Release(double bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    available_ += bytes;
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  double available_;
+};
+
+// Holds bytes of a MemoryBudget until it goes out of scope.
+class BudgetReservation {
+ public:
+  BudgetReservation(MemoryBudget* budget, double bytes)
+      : budget_(budget), bytes_(bytes) {
+    budget_->Acquire(bytes_);
+  }
+
+  ~BudgetReservation() { budget_->Release(bytes_); }
+
+  // Grows the reservation to bytes. The current reservation is released
+  // first, so that two holders can't wait on each other forever.
+  void GrowTo(double bytes) {
+    if (bytes <= bytes_) return;
+    budget_->Release(bytes_);
+    budget_->Acquire(bytes);
+    bytes_ = bytes;
+  }
+
+ private:
+  MemoryBudget* budget_;
+  double bytes_;
+};
+
+// Reads "input output" filename pairs, one per line, from list_filename and
+// compresses them on num_jobs threads. Empty lines and lines starting with
+// '#' are skipped. Prints a status line for each file and the total
+// throughput to standard output. Returns the number of failed files.
+int RunBatch(Options opts, bool verbose, const char* list_filename,
+             int num_jobs) {
+  std::string list;
+  if (!ReadFile(list_filename, &list)) {
+    return 1;
+  }
+  std::vector<std::pair<std::string, std::string> > files;
+  std::istringstream lines(list);
+  std::string line;
+  for (int line_no = 1; std::getline(lines, line); ++line_no) {
+    std::istringstream fields(line);
+    std::string in_filename, out_filename, rest;
+    if (!(fields >> in_filename) || in_filename[0] == '#') continue;
+    if (!(fields >> out_filename) || (fields >> rest)) {
+      fprintf(stderr, "%s:%d: expected an input and an output filename\n",
+              list_filename, line_no);
+      return 1;
+    }
+    // The status lines go to standard output.
+    if (out_filename == "-") {
+      fprintf(stderr, "%s:%d: can't write to standard output in --batch "
+              "mode\n", list_filename, line_no);
+      return 1;
+    }
+    files.emplace_back(in_filename, out_filename);
+  }
+
+  // The jobs share the hardware threads.
+  opts.params.num_threads =
+      std::max(1, guetzli::ThreadPool::DefaultNumThreads() / num_jobs);
+  MemoryBudget budget(opts.memlimit_mb == -1 ?
+                      std::numeric_limits<double>::infinity() :
+                      static_cast<double>(opts.memlimit_mb) * (1 << 20));
+  std::mutex output_mutex;
+  std::atomic<int> num_failed(0);
+  std::atomic<long long> total_pixels(0);
+  const auto start = std::chrono::steady_clock::now();
+  {
+    guetzli::ThreadPool pool(num_jobs);
+    for (const auto& file : files) {
+      pool.Schedule([&, file] {
+        const char* in_filename = file.first.c_str();
+        const char* out_filename = file.second.c_str();
+        const auto file_start = std::chrono::steady_clock::now();
+        std::string in_data;
+        int xsize = 0, ysize = 0;
+        size_t out_size = 0;
+        bool ok = ReadFile(in_filename, &in_data);
+        if (ok && !ReadInputSize(opts, in_data, &xsize, &ysize)) {
+          fprintf(stderr, "Error reading the image size of %s\n",
+                  in_filename);
+          ok = false;
+        }
+        if (ok && MemoryLimitExceeded(opts, xsize, ysize)) {
+          fprintf(stderr, "Memory limit would be exceeded. Failing.\n");
+          ok = false;
+        }
+        if (ok) {
+          const double bytes = MemoryUse(xsize, ysize);
+          budget.Acquire(bytes);
+          guetzli::ProcessStats stats;
+          if (verbose) {
+            stats.debug_output_file = stderr;
+          }
+          ok = CompressFile(opts, &stats, in_data, out_filename, &out_size);
+          budget.Release(bytes);
+        }
+        const double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - file_start).count();
+        std::unique_lock<std::mutex> lock(output_mutex);
+        if (ok) {
+          total_pixels += static_cast<long long>(xsize) * ysize;
+          printf("OK %s -> %s: %zu -> %zu bytes, %.3f s\n", in_filename,
+                 out_filename, in_data.size(), out_size, seconds);
+        } else {
+          ++num_failed;
+          printf("FAILED %s -> %s, %.3f s\n", in_filename, out_filename,
+                 seconds);
+        }
+        fflush(stdout);
+      });
+    }
+    pool.Wait();
+  }
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  const double mpix = total_pixels * 1e-6;
+  printf("%zu files, %d failed, %.3f MPix in %.3f s: %.3f MPix/s, "
+         "%.3f files/s\n", files.size(), num_failed.load(), mpix, seconds,
+         seconds > 0 ? mpix / seconds : 0.0,
+         seconds > 0 ? files.size() / seconds : 0.0);
+  return num_failed;
+}
+
+// The --daemon protocol. All integers are big-endian. A request is
+//   uint32 flags (kRequest* bits), uint32 quality (0 for the --quality of
+//   the daemon), uint64 target_bytes (0 for none), uint64 input size,
+//   the input PNG or JPEG bytes,
+// and the response to it is
+//   uint32 status (kResponse*), uint64 size, the output JPEG bytes or an
+//   error message.
+// A connection may send any number of requests, one after the other, and
+// each is answered before the next one is read.
+constexpr uint32_t kRequestProgressive = 1;
+constexpr uint32_t kRequestTry420 = 2;
+constexpr uint32_t kRequestOptimize = 4;
+constexpr uint32_t kRequestRequantize = 8;
+
+constexpr uint32_t kResponseOk = 0;
+// The input could not be compressed.
+constexpr uint32_t kResponseError = 1;
+// The request was malformed or the image is too large for the memory limit.
+constexpr uint32_t kResponseRejected = 2;
+
+// Connections that send nothing for this long are closed.
+constexpr int kReceiveTimeoutSeconds = 60;
+
+bool ReadFully(int fd, void* buf, size_t size) {
+  uint8_t* p = static_cast<uint8_t*>(buf);
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool WriteFully(int fd, const void* buf, size_t size) {
+  const uint8_t* p = static_cast<const uint8_t*>(buf);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool ReadUint(int fd, int num_bytes, uint64_t* value) {
+  uint8_t buf[8];
+  if (!ReadFully(fd, buf, num_bytes)) return false;
+  *value = 0;
+  for (int i = 0; i < num_bytes; ++i) {
+    *value = (*value << 8) | buf[i];
+  }
+  return true;
+}
+
+bool WriteResponse(int fd, uint32_t status, const std::string& payload) {
+  uint8_t header[12];
+  const uint64_t size = payload.size();
+  for (int i = 0; i < 4; ++i) header[i] = status >> (24 - 8 * i);
+  for (int i = 0; i < 8; ++i) header[4 + i] = size >> (56 - 8 * i);
+  return (WriteFully(fd, header, sizeof(header)) &&
+          WriteFully(fd, payload.data(), payload.size()));
+}
+
+// Answers the requests on the connection fd until the client closes it, an
+// I/O error occurs or no data arrives for kReceiveTimeoutSeconds.
+void ServeConnection(const Options& daemon_opts, bool verbose,
+                     MemoryBudget* budget, int fd) {
+  struct timeval timeout;
+  timeout.tv_sec = kReceiveTimeoutSeconds;
+  timeout.tv_usec = 0;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                 sizeof(timeout)) != 0) {
+    perror("setsockopt");
+    return;
+  }
+  // Larger inputs are rejected before they are read.
+  const uint64_t max_input_size = daemon_opts.memlimit_mb == -1 ?
+      std::numeric_limits<uint64_t>::max() :
+      static_cast<uint64_t>(daemon_opts.memlimit_mb) << 20;
+  for (;;) {
+    uint64_t flags, quality, target_bytes, input_size;
+    if (!ReadUint(fd, 4, &flags) || !ReadUint(fd, 4, &quality) ||
+        !ReadUint(fd, 8, &target_bytes) || !ReadUint(fd, 8, &input_size)) {
+      return;
+    }
+    if (input_size > max_input_size) {
+      WriteResponse(fd, kResponseRejected, "Input is too large");
+      return;
+    }
+    // The input counts against the budget before it is allocated.
+    BudgetReservation reservation(budget, input_size);
+    std::string in_data(input_size, '\0');
+    if (!ReadFully(fd, &in_data[0], input_size)) {
+      return;
+    }
+
+    Options opts = daemon_opts;
+    if (quality > 0) {
+      opts.quality = std::min<uint64_t>(quality, 100);
+      opts.params.target_distance = guetzli::DistanceForQuality(opts.quality);
+    }
+    opts.params.progressive = (flags & kRequestProgressive) != 0;
+    opts.params.try_420 = (flags & kRequestTry420) != 0;
+    opts.params.target_bytes = target_bytes;
+    opts.optimize = (flags & (kRequestOptimize | kRequestRequantize)) != 0;
+    opts.requantize = (flags & kRequestRequantize) != 0;
+
+    int xsize, ysize;
+    if (!ReadInputSize(opts, in_data, &xsize, &ysize)) {
+      if (!WriteResponse(fd, kResponseRejected, "Unknown image format")) {
+        return;
+      }
+      continue;
+    }
+    if (MemoryLimitExceeded(opts, xsize, ysize)) {
+      if (!WriteResponse(fd, kResponseRejected,
+                         "Memory limit would be exceeded")) {
+        return;
+      }
+      continue;
+    }
+    reservation.GrowTo(MemoryUse(xsize, ysize));
+    guetzli::ProcessStats stats;
+    if (verbose) {
+      stats.debug_output_file = stderr;
+    }
+    std::string out_data;
+    const bool ok = Compress(opts, &stats, in_data, &out_data);
+    in_data.clear();
+    in_data.shrink_to_fit();
+    if (!(ok ? WriteResponse(fd, kResponseOk, out_data) :
+          WriteResponse(fd, kResponseError, "Guetzli processing failed"))) {
+      return;
+    }
+  }
+}
+
+// Listens on the Unix domain socket socket_path and serves up to num_jobs
+// connections at once. The images in flight share the memory limit. Only
+// returns on errors.
+int RunDaemon(Options opts, bool verbose, const char* socket_path,
+              int num_jobs) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    return 1;
+  }
+  // Replace the socket of a previous daemon, but never any other file.
+  struct stat st;
+  if (lstat(socket_path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Not a socket: %s\n", socket_path);
+      close(listen_fd);
+      return 1;
+    }
+    unlink(socket_path);
+  } else if (errno != ENOENT) {
+    perror(socket_path);
+    close(listen_fd);
+    return 1;
+  }
+  if (bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) != 0 ||
+      listen(listen_fd, SOMAXCONN) != 0) {
+    perror("Can't listen on socket");
+    close(listen_fd);
+    return 1;
   }
+  // Clients that disconnect early must not kill the daemon.
+  signal(SIGPIPE, SIG_IGN);
+
+  opts.params.num_threads =
+      std::max(1, guetzli::ThreadPool::DefaultNumThreads() / num_jobs);
+  MemoryBudget budget(opts.memlimit_mb == -1 ?
+                      std::numeric_limits<double>::infinity() :
+                      static_cast<double>(opts.memlimit_mb) * (1 << 20));
+  // With one job, the connections are served on this thread.
+  guetzli::ThreadPool pool(num_jobs);
+  for (;;) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      break;
+    }
+    pool.Schedule([&opts, verbose, &budget, fd] {
+      ServeConnection(opts, verbose, &budget, fd);
+      close(fd);
+    });
+  }
+  close(listen_fd);
+  pool.Wait();
+  return 1;
 }
 
 void TerminateHandler() {
@@ -215,6 +1131,8 @@ void Usage() {
   fprintf(stderr,
       "Guetzli JPEG compressor. Usage: \n"
       "guetzli [flags] input_filename output_filename\n"
+      "guetzli [flags] --batch list_filename\n"
+      "guetzli [flags] --daemon socket_path\n"
       "\n"
       "Flags:\n"
       "  --verbose    - Print a verbose trace of all attempts to standard output.\n"
@@ -222,7 +1140,39 @@ void Usage() {
       "                 Default value is %d.\n"
       "  --memlimit M - Memory limit in MB. Guetzli will fail if unable to stay under\n"
       "                 the limit. Default limit is %d MB.\n"
-      "  --nomemlimit - Do not limit memory usage.\n", kDefaultJPEGQuality, kDefaultMemlimitMB);
+      "  --nomemlimit - Do not limit memory usage.\n"
+      "  --optimize   - Losslessly re-encode a JPEG input with optimal Huffman\n"
+      "                 codes only, and report the input and output sizes.\n"
+      "  --requantize - Like --optimize, but first move the JPEG coefficients\n"
+      "                 to the standard quantization tables of --quality.\n"
+      "  --target-bytes N - Encode with the highest standard JPEG quality whose\n"
+      "                 output fits in N bytes.\n"
+      "  --progressive - Write a progressive JPEG.\n"
+      "  --try420     - Also try 4:2:0 chroma subsampling, and keep it if the\n"
+      "                 output is smaller.\n"
+      "  --cache-dir D - Reuse the results of earlier runs with the same input\n"
+      "                 and flags from the existing directory D, and add the\n"
+      "                 result of this run to it.\n"
+      "  --cache-size M - Size limit of the --cache-dir directory in MB. The\n"
+      "                 least recently used results are removed first. Default\n"
+      "                 limit is %d MB.\n"
+      "  --batch L    - Compress the input and output filename pairs listed one\n"
+      "                 per line in file L, or in standard input if L is -.\n"
+      "                 The memory limit applies to all images in flight.\n"
+      "  --jobs N     - Number of images to compress at once in --batch mode.\n"
+      "                 Default is one per hardware thread.\n"
+      "  --daemon S   - Serve compression requests on the Unix domain socket S.\n"
+      "                 --jobs connections are served at once, and the memory\n"
+      "                 limit applies to all images in flight.\n"
+      "  --raw-size WxH - Read the inputs as headerless W x H images in the\n"
+      "                 --raw-format. Without it, the inputs are PNG, binary\n"
+      "                 PGM/PPM/PAM or JPEG files.\n"
+      "  --raw-format F - The layout of the --raw-size inputs: rgb (interleaved\n"
+      "                 8-bit RGB, the default), or yuv444 or yuv420 (8-bit\n"
+      "                 full range Y, Cb and Cr planes one after another, the\n"
+      "                 chroma planes halved in both directions for yuv420).\n"
+      "                 yuv420 input is encoded with 4:2:0 chroma subsampling.\n",
+      kDefaultJPEGQuality, kDefaultMemlimitMB, kDefaultCacheSizeMB);
   exit(1);
 }
 
@@ -232,8 +1182,16 @@ int main(int argc, char** argv) {
   std::set_terminate(TerminateHandler);
 
   int verbose = 0;
-  int quality = kDefaultJPEGQuality;
-  int memlimit_mb = kDefaultMemlimitMB;
+  Options opts;
+  bool progressive = false;
+  bool try_420 = false;
+  const char* cache_dir = nullptr;
+  int cache_size_mb = kDefaultCacheSizeMB;
+  long long target_bytes = 0;
+  const char* batch_filename = nullptr;
+  const char* socket_path = nullptr;
+  int num_jobs = guetzli::ThreadPool::DefaultNumThreads();
+  const char* raw_format = nullptr;
 
   int opt_idx = 1;
   for(;opt_idx < argc;opt_idx++) {
@@ -245,14 +1203,75 @@ int main(int argc, char** argv) {
       opt_idx++;
       if (opt_idx >= argc)
         Usage();
-      quality = atoi(argv[opt_idx]);
+      opts.quality = atoi(argv[opt_idx]);
     } else if (!strcmp(argv[opt_idx], "--memlimit")) {
       opt_idx++;
       if (opt_idx >= argc)
         Usage();
-      memlimit_mb = atoi(argv[opt_idx]);
+      opts.memlimit_mb = atoi(argv[opt_idx]);
     } else if (!strcmp(argv[opt_idx], "--nomemlimit")) {
-      memlimit_mb = -1;
+      opts.memlimit_mb = -1;
+    } else if (!strcmp(argv[opt_idx], "--optimize")) {
+      opts.optimize = true;
+    } else if (!strcmp(argv[opt_idx], "--requantize")) {
+      opts.optimize = true;
+      opts.requantize = true;
+    } else if (!strcmp(argv[opt_idx], "--target-bytes")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      target_bytes = atoll(argv[opt_idx]);
+      if (target_bytes <= 0)
+        Usage();
+    } else if (!strcmp(argv[opt_idx], "--progressive")) {
+      progressive = true;
+    } else if (!strcmp(argv[opt_idx], "--try420")) {
+      try_420 = true;
+    } else if (!strcmp(argv[opt_idx], "--cache-dir")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      cache_dir = argv[opt_idx];
+    } else if (!strcmp(argv[opt_idx], "--cache-size")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      cache_size_mb = atoi(argv[opt_idx]);
+      if (cache_size_mb <= 0)
+        Usage();
+    } else if (!strcmp(argv[opt_idx], "--batch")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      batch_filename = argv[opt_idx];
+    } else if (!strcmp(argv[opt_idx], "--daemon")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      socket_path = argv[opt_idx];
+    } else if (!strcmp(argv[opt_idx], "--jobs")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      num_jobs = atoi(argv[opt_idx]);
+      if (num_jobs <= 0)
+        Usage();
+    } else if (!strcmp(argv[opt_idx], "--raw-size")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      char x;
+      char rest;
+      if (sscanf(argv[opt_idx], "%d%c%d%c", &opts.raw_xsize, &x,
+                 &opts.raw_ysize, &rest) != 3 || x != 'x' ||
+          opts.raw_xsize <= 0 || opts.raw_xsize >= 1 << 16 ||
+          opts.raw_ysize <= 0 || opts.raw_ysize >= 1 << 16)
+        Usage();
+    } else if (!strcmp(argv[opt_idx], "--raw-format")) {
+      opt_idx++;
+      if (opt_idx >= argc)
+        Usage();
+      raw_format = argv[opt_idx];
     } else if (!strcmp(argv[opt_idx], "--")) {
       opt_idx++;
       break;
@@ -262,14 +1281,46 @@ int main(int argc, char** argv) {
     }
   }
 
-  if (argc - opt_idx != 2) {
+  if (argc - opt_idx != (batch_filename || socket_path ? 0 : 2) ||
+      (batch_filename && socket_path)) {
     Usage();
   }
 
-  std::string in_data = ReadFileOrDie(argv[opt_idx]);
-  std::string out_data;
+  if (opts.raw_xsize > 0) {
+    if (!raw_format || !strcmp(raw_format, "rgb")) {
+      opts.raw_format = kRawRGB;
+    } else if (!strcmp(raw_format, "yuv444")) {
+      opts.raw_format = kRawYUV444;
+    } else if (!strcmp(raw_format, "yuv420")) {
+      opts.raw_format = kRawYUV420;
+    } else {
+      fprintf(stderr, "Unknown --raw-format: %s\n", raw_format);
+      Usage();
+    }
+  } else if (raw_format) {
+    Usage();
+  }
 
-  guetzli::Params params;
+  opts.params.target_distance = guetzli::DistanceForQuality(opts.quality);
+  opts.params.progressive = progressive;
+  opts.params.try_420 = try_420;
+  opts.params.target_bytes = target_bytes;
+
+  std::unique_ptr<guetzli::ResultCache> cache;
+  if (cache_dir) {
+    cache.reset(new guetzli::ResultCache(
+        cache_dir, static_cast<size_t>(cache_size_mb) << 20));
+    opts.cache = cache.get();
+  }
+
+  if (socket_path) {
+    return RunDaemon(opts, verbose, socket_path, num_jobs);
+  }
+  if (batch_filename) {
+    return RunBatch(opts, verbose, batch_filename, num_jobs) == 0 ? 0 : 1;
+  }
+
+  std::string in_data = ReadFileOrDie(argv[opt_idx]);
 
   guetzli::ProcessStats stats;
 
@@ -277,47 +1328,14 @@ int main(int argc, char** argv) {
     stats.debug_output_file = stderr;
   }
 
-  static const unsigned char kPNGMagicBytes[] = {
-      0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
-  };
-  if (in_data.size() >= 8 &&
-      memcmp(in_data.data(), kPNGMagicBytes, sizeof(kPNGMagicBytes)) == 0) {
-    int xsize, ysize;
-    std::vector<uint8_t> rgb;
-    if (!ReadPNG(in_data, &xsize, &ysize, &rgb)) {
-      fprintf(stderr, "Error reading PNG data from input file\n");
-      return 1;
-    }
-    double pixels = static_cast<double>(xsize) * ysize;
-    if (memlimit_mb != -1
-        && (pixels * kBytesPerPixel / (1 << 20) > memlimit_mb
-            || memlimit_mb < kLowestMemusageMB)) {
-      fprintf(stderr, "Memory limit would be exceeded. Failing.\n");
-      return 1;
-    }
-    if (!guetzli::Process(params, &stats, rgb, xsize, ysize, &out_data)) {
-      fprintf(stderr, "Guetzli processing failed\n");
-      return 1;
-    }
-  } else {
-    guetzli::JPEGData jpg_header;
-    if (!guetzli::ReadJpeg(in_data, guetzli::JPEG_READ_HEADER, &jpg_header)) {
-      fprintf(stderr, "Error reading JPG data from input file\n");
-      return 1;
-    }
-    double pixels = static_cast<double>(jpg_header.width) * jpg_header.height;
-    if (memlimit_mb != -1
-        && (pixels * kBytesPerPixel / (1 << 20) > memlimit_mb
-            || memlimit_mb < kLowestMemusageMB)) {
-      fprintf(stderr, "Memory limit would be exceeded. Failing.\n");
-      return 1;
-    }
-    if (!guetzli::Process(params, &stats, in_data, &out_data)) {
-      fprintf(stderr, "Guetzli processing failed\n");
-      return 1;
-    }
+  size_t out_size;
+  if (!CompressFile(opts, &stats, in_data, argv[opt_idx + 1], &out_size)) {
+    return 1;
+  }
+  if (opts.optimize) {
+    fprintf(stderr, "%d -> %d bytes\n",
+            stats.counters[guetzli::kInputSizeCnt],
+            stats.counters[guetzli::kOutputSizeCnt]);
   }
-
-  WriteFileOrDie(argv[opt_idx + 1], out_data);
   return 0;
 }
@@ -20,6 +20,11 @@
 
 #include <algorithm>
 #include <math.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
 
 namespace guetzli {
 
@@ -37,6 +42,25 @@ static const int kIDCTMatrix[kDCTBlockSize] = {
   8192, -11363,  10703,  -9633,   8192,  -6437,   4433,  -2260,
 };
 
+// kIDCTMatrix4[4*x+u] = alpha(u)*cos((2*x+1)*u*M_PI/8)*sqrt(2) and
+// kIDCTMatrix2[2*x+u] = alpha(u)*cos((2*x+1)*u*M_PI/4)*sqrt(2), with the same
+// fixed 13 bit precision as above. The reduced transforms use the same scaling
+// as the full one, so the DC coefficient contributes the same value to every
+// output pixel.
+static const int kIDCTMatrix4[4 * 4] = {
+  8192,  10703,   8192,   4433,
+  8192,   4433,  -8192, -10703,
+  8192,  -4433,  -8192,  10703,
+  8192, -10703,   8192,  -4433,
+};
+
+static const int kIDCTMatrix2[2 * 2] = {
+  8192,   8192,
+  8192,  -8192,
+};
+
+static const int kIDCTMatrix1[1] = { 8192 };
+
 // Computes out[x] = sum{kIDCTMatrix[8*x+u]*in[u*stride]; for u in [0..7]}
 inline void Compute1dIDCT(const coeff_t* in, const int stride, int out[8]) {
   int tmp0, tmp1, tmp2, tmp3, tmp4;
@@ -136,10 +160,133 @@ inline void Compute1dIDCT(const coeff_t* in, const int stride, int out[8]) {
   out[7] -= tmp1;
 }
 
-void ComputeBlockIDCT(const coeff_t* block, uint8_t* out) {
+namespace {
+
+const int kColScale = 11;
+const int kColRound = 1 << (kColScale - 1);
+const int kRowScale = 18;
+const int kRowRound = 257 << (kRowScale - 1);  // includes offset by 128
+
+// Returns the value of every output pixel of a block whose only non-zero
+// coefficient is the DC, rounded the same way as the full transform.
+inline uint8_t DCOnlyIDCTValue(coeff_t dc) {
+  const coeff_t col = (kIDCTMatrix[0] * dc + kColRound) >> kColScale;
+  return std::max(0, std::min(255, (kIDCTMatrix[0] * col + kRowRound) >>
+                                   kRowScale));
+}
+
+#ifdef __SSE2__
+
+inline __m128i IDCTPair(int u, int y) {
+  const int lo = kIDCTMatrix[8 * y + u] & 0xffff;
+  const int hi = kIDCTMatrix[8 * y + u + 1] << 16;
+  return _mm_set1_epi32(hi | lo);
+}
+
+// Transposes the 8x8 matrix of 16-bit values in v[].
+inline void Transpose8x8(__m128i v[8]) {
+  const __m128i a0 = _mm_unpacklo_epi16(v[0], v[1]);
+  const __m128i a1 = _mm_unpackhi_epi16(v[0], v[1]);
+  const __m128i a2 = _mm_unpacklo_epi16(v[2], v[3]);
+  const __m128i a3 = _mm_unpackhi_epi16(v[2], v[3]);
+  const __m128i a4 = _mm_unpacklo_epi16(v[4], v[5]);
+  const __m128i a5 = _mm_unpackhi_epi16(v[4], v[5]);
+  const __m128i a6 = _mm_unpacklo_epi16(v[6], v[7]);
+  const __m128i a7 = _mm_unpackhi_epi16(v[6], v[7]);
+  const __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+  const __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+  const __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+  const __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+  const __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+  const __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+  const __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+  const __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+  v[0] = _mm_unpacklo_epi64(b0, b4);
+  v[1] = _mm_unpackhi_epi64(b0, b4);
+  v[2] = _mm_unpacklo_epi64(b1, b5);
+  v[3] = _mm_unpackhi_epi64(b1, b5);
+  v[4] = _mm_unpacklo_epi64(b2, b6);
+  v[5] = _mm_unpackhi_epi64(b2, b6);
+  v[6] = _mm_unpacklo_epi64(b3, b7);
+  v[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+// Computes out[y][x] = sum{kIDCTMatrix[8*y+u]*in[u][x]; for u in [0..n)} with
+// 32-bit precision for the eight columns x in parallel, where in[] holds the
+// rows of 16-bit input values. Only the first n rows of in[] are read, the
+// others are assumed to be zero. The results for x = 0..3 are written to
+// lo[y] and for x = 4..7 to hi[y].
+template <int n>
+inline void IDCTColumns(const __m128i in[8], __m128i lo[8], __m128i hi[8]) {
+  __m128i pairs_lo[4];
+  __m128i pairs_hi[4];
+  for (int u = 0; u < n; u += 2) {
+    pairs_lo[u / 2] = _mm_unpacklo_epi16(in[u], in[u + 1]);
+    pairs_hi[u / 2] = _mm_unpackhi_epi16(in[u], in[u + 1]);
+  }
+  for (int y = 0; y < 8; ++y) {
+    __m128i sum_lo = _mm_setzero_si128();
+    __m128i sum_hi = _mm_setzero_si128();
+    for (int u = 0; u < n; u += 2) {
+      const __m128i m = IDCTPair(u, y);
+      sum_lo = _mm_add_epi32(sum_lo, _mm_madd_epi16(pairs_lo[u / 2], m));
+      sum_hi = _mm_add_epi32(sum_hi, _mm_madd_epi16(pairs_hi[u / 2], m));
+    }
+    lo[y] = sum_lo;
+    hi[y] = sum_hi;
+  }
+}
+
+// Rounds the 32-bit column transform outputs and truncates them to coeff_t,
+// the same way the scalar code stores them.
+inline __m128i ColumnOutput(__m128i lo, __m128i hi) {
+  const __m128i round = _mm_set1_epi32(kColRound);
+  lo = _mm_srai_epi32(_mm_add_epi32(lo, round), kColScale);
+  hi = _mm_srai_epi32(_mm_add_epi32(hi, round), kColScale);
+  lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+  hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+  return _mm_packs_epi32(lo, hi);
+}
+
+// Rounds the 32-bit row transform outputs to 16 bits, saturating values that
+// are out of range anyway.
+inline __m128i RowOutput(__m128i lo, __m128i hi) {
+  const __m128i round = _mm_set1_epi32(kRowRound);
+  lo = _mm_srai_epi32(_mm_add_epi32(lo, round), kRowScale);
+  hi = _mm_srai_epi32(_mm_add_epi32(hi, round), kRowScale);
+  return _mm_packs_epi32(lo, hi);
+}
+
+// Computes the inverse DCT of a block whose non-zero coefficients are all in
+// the first n rows and the first n columns, for n = 4 or 8.
+template <int n>
+void ComputeBlockIDCTSSE2(const __m128i rows[8], uint8_t* out) {
+  __m128i lo[8];
+  __m128i hi[8];
+  __m128i v[8];
+  IDCTColumns<n>(rows, lo, hi);
+  for (int y = 0; y < 8; ++y) {
+    v[y] = ColumnOutput(lo[y], hi[y]);
+  }
+  // After the transpose, v[u] holds the coefficient u of each row, so the row
+  // transform of all eight rows can be computed the same way as above.
+  // Rows u >= n are zero, because the corresponding input columns were zero.
+  Transpose8x8(v);
+  IDCTColumns<n>(v, lo, hi);
+  for (int x = 0; x < 8; ++x) {
+    v[x] = RowOutput(lo[x], hi[x]);
+  }
+  Transpose8x8(v);
+  __m128i* dst = reinterpret_cast<__m128i*>(out);
+  for (int y = 0; y < 8; y += 2) {
+    _mm_storeu_si128(dst + y / 2, _mm_packus_epi16(v[y], v[y + 1]));
+  }
+}
+
+#else  // __SSE2__
+
+void ComputeBlockIDCTScalar(const coeff_t* block, uint8_t* out) {
   coeff_t colidcts[kDCTBlockSize];
-  const int kColScale = 11;
-  const int kColRound = 1 << (kColScale - 1);
   for (int x = 0; x < 8; ++x) {
     int colbuf[8] = { 0 };
     Compute1dIDCT(&block[x], 8, colbuf);
@@ -147,8 +294,6 @@ void ComputeBlockIDCT(const coeff_t* block, uint8_t* out) {
       colidcts[8 * y + x] = (colbuf[y] + kColRound) >> kColScale;
     }
   }
-  const int kRowScale = 18;
-  const int kRowRound = 257 << (kRowScale - 1);  // includes offset by 128
   for (int y = 0; y < 8; ++y) {
     const int rowidx = 8 * y;
     int rowbuf[8] = { 0 };
@@ -160,4 +305,89 @@ void ComputeBlockIDCT(const coeff_t* block, uint8_t* out) {
   }
 }
 
+#endif  // __SSE2__
+
+}  // namespace
+
+void ComputeBlockIDCT(const coeff_t* block, uint8_t* out) {
+#ifdef __SSE2__
+  // Most blocks of a strongly quantized image have only a few low-frequency
+  // coefficients, so check which part of the block is populated first.
+  __m128i rows[8];
+  const __m128i* src = reinterpret_cast<const __m128i*>(block);
+  for (int y = 0; y < 8; ++y) {
+    rows[y] = _mm_loadu_si128(src + y);
+  }
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i high_rows = _mm_or_si128(_mm_or_si128(rows[4], rows[5]),
+                                         _mm_or_si128(rows[6], rows[7]));
+  const __m128i low_rows = _mm_or_si128(_mm_or_si128(rows[0], rows[1]),
+                                        _mm_or_si128(rows[2], rows[3]));
+  // The bits of the mask are set for the 16-bit lanes of the combined rows
+  // that are zero (two mask bits per lane).
+  const int high_zero = _mm_movemask_epi8(_mm_cmpeq_epi16(high_rows, zero));
+  const int low_zero = _mm_movemask_epi8(_mm_cmpeq_epi16(low_rows, zero));
+  if (high_zero == 0xffff && (low_zero & 0xff00) == 0xff00) {
+    const __m128i ac_rows = _mm_or_si128(
+        _mm_or_si128(rows[1], rows[2]),
+        _mm_or_si128(rows[3], _mm_srli_si128(rows[0], 2)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(ac_rows, zero)) == 0xffff) {
+      memset(out, DCOnlyIDCTValue(block[0]), kDCTBlockSize);
+      return;
+    }
+    ComputeBlockIDCTSSE2<4>(rows, out);
+    return;
+  }
+  ComputeBlockIDCTSSE2<8>(rows, out);
+#else  // __SSE2__
+  bool dc_only = true;
+  for (int k = 1; k < kDCTBlockSize; ++k) {
+    if (block[k] != 0) {
+      dc_only = false;
+      break;
+    }
+  }
+  if (dc_only) {
+    memset(out, DCOnlyIDCTValue(block[0]), kDCTBlockSize);
+    return;
+  }
+  ComputeBlockIDCTScalar(block, out);
+#endif  // __SSE2__
+}
+
+void ComputeBlockIDCTScaled(const coeff_t* block, int size, uint8_t* out) {
+  const int* matrix;
+  switch (size) {
+    case 1: matrix = kIDCTMatrix1; break;
+    case 2: matrix = kIDCTMatrix2; break;
+    case 4: matrix = kIDCTMatrix4; break;
+    default:
+      ComputeBlockIDCT(block, out);
+      return;
+  }
+  // Same rounding and scaling as in ComputeBlockIDCT(), but only the top-left
+  // size x size coefficients are used.
+  coeff_t colidcts[4 * 4];
+  for (int x = 0; x < size; ++x) {
+    for (int y = 0; y < size; ++y) {
+      int sum = 0;
+      for (int u = 0; u < size; ++u) {
+        sum += matrix[size * y + u] * block[8 * u + x];
+      }
+      colidcts[size * y + x] = (sum + kColRound) >> kColScale;
+    }
+  }
+  for (int y = 0; y < size; ++y) {
+    const coeff_t* row = &colidcts[size * y];
+    for (int x = 0; x < size; ++x) {
+      int sum = 0;
+      for (int u = 0; u < size; ++u) {
+        sum += matrix[size * x + u] * row[u];
+      }
+      out[size * y + x] =
+          std::max(0, std::min(255, (sum + kRowRound) >> kRowScale));
+    }
+  }
+}
+
 }  // namespace guetzli
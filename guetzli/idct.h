@@ -26,6 +26,13 @@ namespace guetzli {
 // a row-by-row memory layout.
 void ComputeBlockIDCT(const coeff_t* block, uint8_t* result);
 
+// Fills in 'result' with the size x size reduced inverse DCT of the top-left
+// size x size coefficients of 'block', which approximates the 8x8 inverse DCT
+// downscaled by a factor of 8 / size. The value of 'size' must be 1, 2, 4 or 8,
+// 'block' points to an 8x8 array and 'result' to a size x size array, both
+// arranged in a row-by-row memory layout.
+void ComputeBlockIDCTScaled(const coeff_t* block, int size, uint8_t* result);
+
 }  // namespace guetzli
 
 #endif  // GUETZLI_IDCT_H_
@@ -67,6 +67,28 @@ void InitJPEGDataForYUV444(int w, int h, JPEGData* jpg) {
   }
 }
 
+void InitJPEGDataForYUV420(int w, int h, JPEGData* jpg) {
+  jpg->width = w;
+  jpg->height = h;
+  jpg->max_h_samp_factor = 2;
+  jpg->max_v_samp_factor = 2;
+  jpg->MCU_rows = (h + 15) >> 4;
+  jpg->MCU_cols = (w + 15) >> 4;
+  jpg->quant.resize(3);
+  jpg->components.resize(3);
+  for (int i = 0; i < 3; ++i) {
+    JPEGComponent* c = &jpg->components[i];
+    c->id = i;
+    c->h_samp_factor = i == 0 ? 2 : 1;
+    c->v_samp_factor = i == 0 ? 2 : 1;
+    c->quant_idx = i;
+    c->width_in_blocks = jpg->MCU_cols * c->h_samp_factor;
+    c->height_in_blocks = jpg->MCU_rows * c->v_samp_factor;
+    c->num_blocks = c->width_in_blocks * c->height_in_blocks;
+    c->coeffs.resize(c->num_blocks * kDCTBlockSize);
+  }
+}
+
 void SaveQuantTables(const int q[3][kDCTBlockSize], JPEGData* jpg) {
   const size_t kTableSize = kDCTBlockSize * sizeof(q[0][0]);
   jpg->quant.clear();
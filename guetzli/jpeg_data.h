@@ -204,6 +204,7 @@ struct JPEGData {
 };
 
 void InitJPEGDataForYUV444(int w, int h, JPEGData* jpg);
+void InitJPEGDataForYUV420(int w, int h, JPEGData* jpg);
 void SaveQuantTables(const int q[3][kDCTBlockSize], JPEGData* jpg);
 
 }  // namespace guetzli
@@ -16,10 +16,73 @@
 
 #include "guetzli/jpeg_data_decoder.h"
 
+#include <algorithm>
+#include <string.h>
+
+#include "guetzli/color_transform.h"
+#include "guetzli/idct.h"
 #include "guetzli/output_image.h"
+#include "guetzli/upsample.h"
 
 namespace guetzli {
 
+namespace {
+
+// Decodes the coefficient block row 'block_y' of 'comp' into the rows
+// 8 * block_y ... 8 * block_y + 7 of a cyclic buffer of 'num_rows' pixel rows,
+// each 'stride' bytes long.
+void DecodeBlockRow(const JPEGComponent& comp, const int* quant, int block_y,
+                    int stride, int num_rows, uint8_t* out) {
+  const coeff_t* src_coeffs =
+      &comp.coeffs[block_y * comp.width_in_blocks * kDCTBlockSize];
+  for (int block_x = 0; block_x < comp.width_in_blocks; ++block_x) {
+    coeff_t block[kDCTBlockSize];
+    for (int i = 0; i < kDCTBlockSize; ++i) {
+      block[i] = src_coeffs[i] * quant[i];
+    }
+    uint8_t idct[kDCTBlockSize];
+    ComputeBlockIDCT(block, idct);
+    for (int iy = 0; iy < 8; ++iy) {
+      const int row = (8 * block_y + iy) % num_rows;
+      memcpy(&out[row * stride + 8 * block_x], &idct[8 * iy], 8);
+    }
+    src_coeffs += kDCTBlockSize;
+  }
+}
+
+struct RGBImage {
+  int width;
+  std::vector<uint8_t> pixels;
+};
+
+bool CopyRGBRow(void* data, int y, const uint8_t* row) {
+  RGBImage* img = reinterpret_cast<RGBImage*>(data);
+  const size_t row_size = 3 * img->width;
+  memcpy(&img->pixels[y * row_size], row, row_size);
+  return true;
+}
+
+}  // namespace
+
+bool CanDecodeJpegToRGB(const JPEGData& jpg) {
+  if (!(jpg.components.size() == 1 ||
+        (jpg.components.size() == 3 &&
+         HasYCbCrColorSpace(jpg) && (jpg.Is420() || jpg.Is444())))) {
+    return false;
+  }
+  for (size_t c = 0; c < jpg.components.size(); ++c) {
+    const JPEGComponent& comp = jpg.components[c];
+    if (comp.quant_idx >= jpg.quant.size() ||
+        comp.width_in_blocks * 8 * jpg.max_h_samp_factor <
+        jpg.width * comp.h_samp_factor ||
+        comp.height_in_blocks * 8 * jpg.max_v_samp_factor <
+        jpg.height * comp.v_samp_factor) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // Mimic libjpeg's heuristics to guess jpeg color space.
 // Requires that the jpg has 3 components.
 bool HasYCbCrColorSpace(const JPEGData& jpg) {
@@ -42,15 +105,177 @@ bool HasYCbCrColorSpace(const JPEGData& jpg) {
   return (cid0 != 'R' || cid1 != 'G' || cid2 != 'B');
 }
 
+bool DecodeJpegToRGBRows(const JPEGData& jpg, RGBRowHook cb, void* data) {
+  if (!CanDecodeJpegToRGB(jpg)) {
+    return false;
+  }
+  const int width = jpg.width;
+  const int height = jpg.height;
+  const size_t ncomp = jpg.components.size();
+  // Full resolution components keep the pixel rows of the current MCU row,
+  // subsampled ones the previous, current and next block row, since the
+  // upsampler needs one more subsampled row above and below.
+  std::vector<std::vector<uint8_t> > buffers(ncomp);
+  std::vector<int> num_rows(ncomp);
+  std::vector<int> strides(ncomp);
+  std::vector<bool> subsampled(ncomp);
+  for (size_t c = 0; c < ncomp; ++c) {
+    const JPEGComponent& comp = jpg.components[c];
+    subsampled[c] = comp.v_samp_factor < jpg.max_v_samp_factor;
+    num_rows[c] = subsampled[c] ? 24 : 8 * comp.v_samp_factor;
+    strides[c] = 8 * comp.width_in_blocks;
+    buffers[c].resize(num_rows[c] * strides[c]);
+  }
+  const int sub_width = (width + 1) / 2;
+  const int sub_height = (height + 1) / 2;
+  const int mcu_height = 8 * jpg.max_v_samp_factor;
+  std::vector<uint16_t> upsampled_row(width);
+  std::vector<uint8_t> upsampled(2 * width);
+  std::vector<uint8_t> rgb_row(3 * width);
+  for (int mcu_y = 0; mcu_y < jpg.MCU_rows; ++mcu_y) {
+    for (size_t c = 0; c < ncomp; ++c) {
+      const JPEGComponent& comp = jpg.components[c];
+      const int* quant = &jpg.quant[comp.quant_idx].values[0];
+      if (subsampled[c]) {
+        if (mcu_y == 0) {
+          DecodeBlockRow(comp, quant, 0, strides[c], num_rows[c],
+                         &buffers[c][0]);
+        }
+        if (mcu_y + 1 < comp.height_in_blocks) {
+          DecodeBlockRow(comp, quant, mcu_y + 1, strides[c], num_rows[c],
+                         &buffers[c][0]);
+        }
+      } else {
+        for (int iy = 0; iy < comp.v_samp_factor; ++iy) {
+          DecodeBlockRow(comp, quant, mcu_y * comp.v_samp_factor + iy,
+                         strides[c], num_rows[c], &buffers[c][0]);
+        }
+      }
+    }
+    const int yend = std::min(height, (mcu_y + 1) * mcu_height);
+    for (int y = mcu_y * mcu_height; y < yend; ++y) {
+      const uint8_t* rows[3];
+      for (size_t c = 0; c < ncomp; ++c) {
+        const uint8_t* buf = &buffers[c][0];
+        if (subsampled[c]) {
+          const int j = y >> 1;
+          const int j1 = std::min(sub_height - 1,
+                                  std::max(0, j + 2 * (y & 1) - 1));
+          uint8_t* out = &upsampled[(c - 1) * width];
+          FancyUpsampleRow(&buf[(j % num_rows[c]) * strides[c]],
+                           &buf[(j1 % num_rows[c]) * strides[c]],
+                           sub_width, width, &upsampled_row[0]);
+          RoundUpsampledRow(&upsampled_row[0], width, out);
+          rows[c] = out;
+        } else {
+          rows[c] = &buf[(y % num_rows[c]) * strides[c]];
+        }
+      }
+      if (ncomp == 1) {
+        for (int x = 0; x < width; ++x) {
+          rgb_row[3 * x] = rgb_row[3 * x + 1] = rgb_row[3 * x + 2] = rows[0][x];
+        }
+      } else {
+        for (int x = 0; x < width; ++x) {
+          uint8_t* pixel = &rgb_row[3 * x];
+          pixel[0] = rows[0][x];
+          pixel[1] = rows[1][x];
+          pixel[2] = rows[2][x];
+          ColorTransformYCbCrToRGB(pixel);
+        }
+      }
+      if (!cb(data, y, &rgb_row[0])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
 std::vector<uint8_t> DecodeJpegToRGB(const JPEGData& jpg) {
-  if (jpg.components.size() == 1 ||
-      (jpg.components.size() == 3 &&
-       HasYCbCrColorSpace(jpg) && (jpg.Is420() || jpg.Is444()))) {
-    OutputImage img(jpg.width, jpg.height);
-    img.CopyFromJpegData(jpg);
-    return img.ToSRGB();
-  }
-  return std::vector<uint8_t>();
+  if (!CanDecodeJpegToRGB(jpg)) {
+    return std::vector<uint8_t>();
+  }
+  RGBImage img;
+  img.width = jpg.width;
+  img.pixels.resize(3 * static_cast<size_t>(jpg.width) * jpg.height);
+  if (!DecodeJpegToRGBRows(jpg, CopyRGBRow, &img)) {
+    return std::vector<uint8_t>();
+  }
+  return img.pixels;
+}
+
+std::vector<uint8_t> DecodeJpegToRGBScaled(const JPEGData& jpg, int scale,
+                                           int* xsize, int* ysize) {
+  if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+    return std::vector<uint8_t>();
+  }
+  if (scale == 1) {
+    *xsize = jpg.width;
+    *ysize = jpg.height;
+    return DecodeJpegToRGB(jpg);
+  }
+  if (!CanDecodeJpegToRGB(jpg)) {
+    return std::vector<uint8_t>();
+  }
+  const int width = (jpg.width + scale - 1) / scale;
+  const int height = (jpg.height + scale - 1) / scale;
+  const size_t ncomp = jpg.components.size();
+  // Each component is reconstructed at the output resolution, a subsampled
+  // component just uses a bigger part of each coefficient block.
+  std::vector<std::vector<uint8_t> > planes(ncomp);
+  std::vector<int> strides(ncomp);
+  for (size_t c = 0; c < ncomp; ++c) {
+    const JPEGComponent& comp = jpg.components[c];
+    const int factor = jpg.max_h_samp_factor / comp.h_samp_factor;
+    const int size = 8 * factor / scale;
+    const int* quant = &jpg.quant[comp.quant_idx].values[0];
+    const int stride = comp.width_in_blocks * size;
+    if (stride < width || comp.height_in_blocks * size < height) {
+      return std::vector<uint8_t>();
+    }
+    std::vector<uint8_t>& plane = planes[c];
+    plane.resize(static_cast<size_t>(stride) * comp.height_in_blocks * size);
+    for (int block_y = 0; block_y < comp.height_in_blocks; ++block_y) {
+      for (int block_x = 0; block_x < comp.width_in_blocks; ++block_x) {
+        const coeff_t* src_coeffs =
+            &comp.coeffs[(block_y * comp.width_in_blocks + block_x) *
+                         kDCTBlockSize];
+        coeff_t block[kDCTBlockSize];
+        for (int i = 0; i < kDCTBlockSize; ++i) {
+          block[i] = src_coeffs[i] * quant[i];
+        }
+        uint8_t idct[kDCTBlockSize];
+        ComputeBlockIDCTScaled(block, size, idct);
+        for (int iy = 0; iy < size; ++iy) {
+          memcpy(&plane[(block_y * size + iy) * stride + block_x * size],
+                 &idct[iy * size], size);
+        }
+      }
+    }
+    strides[c] = stride;
+  }
+  std::vector<uint8_t> rgb(3 * width * height);
+  for (int y = 0; y < height; ++y) {
+    uint8_t* row_out = &rgb[3 * y * width];
+    if (ncomp == 1) {
+      const uint8_t* row_in = &planes[0][y * strides[0]];
+      for (int x = 0; x < width; ++x) {
+        row_out[3 * x] = row_out[3 * x + 1] = row_out[3 * x + 2] = row_in[x];
+      }
+      continue;
+    }
+    for (int x = 0; x < width; ++x) {
+      uint8_t* pixel = &row_out[3 * x];
+      for (int c = 0; c < 3; ++c) {
+        pixel[c] = planes[c][y * strides[c] + x];
+      }
+      ColorTransformYCbCrToRGB(pixel);
+    }
+  }
+  *xsize = width;
+  *ysize = height;
+  return rgb;
 }
 
 }  // namespace guetzli
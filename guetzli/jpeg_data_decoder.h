@@ -25,6 +25,11 @@
 
 namespace guetzli {
 
+// Returns true if the parsed jpeg coefficients can be decoded into an RGB
+// image, i.e. if DecodeJpegToRGB() would not fail. This only looks at the
+// header fields and is much cheaper than decoding.
+bool CanDecodeJpegToRGB(const JPEGData& jpg);
+
 // Decodes the parsed jpeg coefficients into an RGB image.
 // There can be only either 1 or 3 image components, in either case, an RGB
 // output image will be generated.
@@ -32,6 +37,30 @@ namespace guetzli {
 // Vector will be empty if a decoding error occurred.
 std::vector<uint8_t> DecodeJpegToRGB(const JPEGData& jpg);
 
+// Function pointer type used to receive row y of the decoded RGB image, which
+// holds 3 * width bytes. Returns false if decoding should be stopped.
+typedef bool (*RGBRowHook)(void* data, int y, const uint8_t* row);
+
+// Decodes the parsed jpeg coefficients one MCU row at a time and calls cb with
+// each RGB row of the image, in top to bottom order. Only the pixels of the
+// current MCU row (and the neighbouring chroma rows needed for upsampling) are
+// kept in memory, so memory use beyond the coefficients is proportional to the
+// image width. The rows are identical to those returned by DecodeJpegToRGB().
+// Returns false if the image is not supported or if cb returned false.
+bool DecodeJpegToRGBRows(const JPEGData& jpg, RGBRowHook cb, void* data);
+
+// Decodes the parsed jpeg coefficients into an RGB image that is downscaled by
+// 'scale', which must be 1, 2, 4 or 8. For scale > 1 only the top-left
+// (8 / scale) x (8 / scale) coefficients of each block are used, with a
+// matching reduced-size IDCT, and the subsampled components are reconstructed
+// at the output resolution directly, so no upsampling is needed.
+// Fills in *xsize and *ysize with the dimensions of the downscaled image,
+// which are the image dimensions divided by scale, rounded up.
+// Supports the same images as DecodeJpegToRGB(), and the vector will be empty
+// if a decoding error occurred.
+std::vector<uint8_t> DecodeJpegToRGBScaled(const JPEGData& jpg, int scale,
+                                           int* xsize, int* ysize);
+
 // Mimic libjpeg's heuristics to guess jpeg color space.
 // Requires that the jpg has 3 components.
 bool HasYCbCrColorSpace(const JPEGData& jpg);
@@ -25,6 +25,9 @@
 
 #include "guetzli/hwdct.h"
 #include "guetzli/fdct.h"
+#include "guetzli/fast_log.h"
+#include "guetzli/jpeg_data_writer.h"
+#include "guetzli/thread_pool.h"
 
 namespace guetzli {
 
@@ -35,10 +38,30 @@ static const int kIQuantBits = 16;
 static const int kDCTBits = kIQuantBits + 4;
 static const int kBias = 0x80 << (kDCTBits - 8);
 
-void Quantize(coeff_t* v, int iquant) {
-  *v = (*v * iquant + kBias) >> kDCTBits;
+void ComputeIQuant(const int* quant, int iquant[3 * kDCTBlockSize]) {
+  for (int i = 0; i < 3 * kDCTBlockSize; ++i) {
+    iquant[i] = ((1 << kIQuantBits) + 1) / quant[i];
+  }
+}
+
+// Quantizes one block of upscaled DCT coefficients. This is a straight loop
+// over the block, so that the compiler can vectorize it.
+inline void QuantizeBlock(const coeff_t* in, const int* iquant, coeff_t* out) {
+  for (int k = 0; k < kDCTBlockSize; ++k) {
+    out[k] = (in[k] * iquant[k] + kBias) >> kDCTBits;
+  }
 }
 
+// The symbol histograms of the quantized coefficients of one MCU row. The
+// DC histograms leave out the first block of the row, whose DC difference
+// depends on the previous row.
+struct McuRowHistograms {
+  JpegHistogram dc[3];
+  JpegHistogram ac[3];
+  coeff_t first_dc[3];
+  coeff_t last_dc[3];
+};
+
 // Single pixel rgb to 16-bit yuv conversion.
 // The returned yuv values are signed integers in the
 // range [-128, 127] inclusive.
@@ -53,6 +76,21 @@ inline static void RGBToYUV16(const uint8_t* const rgb,
   out[128] = (32768 * r  - 27439 * g -  5329 * b + HALF - 1) >> FRAC;
 }
 
+// Fills in block[] with the Y, Cb and Cr values of the 8x8 block of the rgb
+// image at block coordinates (block_x, block_y), duplicating the edge pixels
+// past the image.
+void RGBToYUVBlock(const std::vector<uint8_t>& rgb, int w, int h,
+                   int block_x, int block_y, coeff_t block[3 * kDCTBlockSize]) {
+  for (int iy = 0; iy < 8; ++iy) {
+    for (int ix = 0; ix < 8; ++ix) {
+      int y = std::min(h - 1, 8 * block_y + iy);
+      int x = std::min(w - 1, 8 * block_x + ix);
+      int p = y * w + x;
+      RGBToYUV16(&rgb[3 * p], &block[8 * iy + ix]);
+    }
+  }
+}
+
 }  // namespace
 
 void AddApp0Data(JPEGData* jpg) {
@@ -68,27 +106,27 @@ void AddApp0Data(JPEGData* jpg) {
                                  sizeof(kApp0Data)));
 }
 
-bool EncodeRGBToJpeg(const std::vector<uint8_t>& rgb, int w, int h,
-                     const int* quant, JPEGData* jpg) {
+bool DCTCoefficientCache::Init(const std::vector<uint8_t>& rgb, int w, int h) {
+  return Init(rgb, w, h, nullptr);
+}
+
+bool DCTCoefficientCache::Init(const std::vector<uint8_t>& rgb, int w, int h,
+                               ThreadPool* pool) {
   if (w < 0 || w >= 1 << 16 || h < 0 || h >= 1 << 16 ||
       rgb.size() != 3 * w * h) {
     return false;
   }
-  InitJPEGDataForYUV444(w, h, jpg);
-  AddApp0Data(jpg);
-
-  int iquant[3 * kDCTBlockSize];
-  int idx = 0;
+  width_ = w;
+  height_ = h;
+  is_420_ = false;
+  mcu_cols_ = (w + 7) >> 3;
+  mcu_rows_ = (h + 7) >> 3;
+  const size_t num_coeffs =
+      static_cast<size_t>(mcu_cols_) * mcu_rows_ * kDCTBlockSize;
   for (int i = 0; i < 3; ++i) {
-    for (int j = 0; j < kDCTBlockSize; ++j) {
-      int v = quant[idx];
-      jpg->quant[i].values[j] = v;
-      iquant[idx++] = ((1 << kIQuantBits) + 1) / v;
-    }
+    coeffs_[i].resize(num_coeffs);
   }
 
-  int block_ix = 0;
-
 #ifdef HLS
   int fdr = open("/dev/xillybus_read_32", O_RDONLY);
   if (fdr < 0) {
@@ -110,28 +148,12 @@ bool EncodeRGBToJpeg(const std::vector<uint8_t>& rgb, int w, int h,
   if (!pid) {
     // Child process does RGB->YUV and then writes to FIFO for DCT
     close(fdr);
-#endif // HLS
-    for (int block_y = 0; block_y < jpg->MCU_rows; ++block_y) {
-      for (int block_x = 0; block_x < jpg->MCU_cols; ++block_x) {
+    for (int block_y = 0; block_y < mcu_rows_; ++block_y) {
+      for (int block_x = 0; block_x < mcu_cols_; ++block_x) {
         coeff_t block[3 * kDCTBlockSize];
-        // RGB->YUV transform.
-        for (int iy = 0; iy < 8; ++iy) {
-          for (int ix = 0; ix < 8; ++ix) {
-            int y = std::min(h - 1, 8 * block_y + iy);
-            int x = std::min(w - 1, 8 * block_x + ix);
-            int p = y * w + x;
-            RGBToYUV16(&rgb[3 * p], &block[8 * iy + ix]);
-          }
-        }
-#ifdef HLS
+        RGBToYUVBlock(rgb, w, h, block_x, block_y, block);
         // Send to FIFO for DCT
         FifoWriteBlock(block, fdw);
-#else
-        for (int i = 0; i < 3; ++i) {
-          ComputeBlockDCT(&block[i * kDCTBlockSize]);
-        }
-#endif // HLS
-#ifdef HLS
       }
     }
     // Sleep until we're terminated, or a minute at max
@@ -140,51 +162,274 @@ bool EncodeRGBToJpeg(const std::vector<uint8_t>& rgb, int w, int h,
   }
   else
   {
-    // Parent process reads DCT coeffs from FIFO and then does quantization
+    // Parent process reads DCT coeffs from FIFO and stores them
     close(fdw);
-    for (int block_y = 0; block_y < jpg->MCU_rows; ++block_y) {
-      for (int block_x = 0; block_x < jpg->MCU_cols; ++block_x) {
+    int block_ix = 0;
+    for (int block_y = 0; block_y < mcu_rows_; ++block_y) {
+      for (int block_x = 0; block_x < mcu_cols_; ++block_x) {
         coeff_t block[3 * kDCTBlockSize];
         // Get DCT coeffs from FIFO
         FifoReadBlock(block, fdr);
-#endif // HLS
-        // Quantization
-        for (int i = 0; i < 3 * 64; ++i) {
-          Quantize(&block[i], iquant[i]);
-        }
-        // Copy the resulting coefficients to *jpg.
+        // Copy the resulting coefficients to the cache.
         for (int i = 0; i < 3; ++i) {
-          memcpy(&jpg->components[i].coeffs[block_ix * kDCTBlockSize],
-                &block[i * kDCTBlockSize], kDCTBlockSize * sizeof(block[0]));
+          memcpy(&coeffs_[i][block_ix * kDCTBlockSize],
+                 &block[i * kDCTBlockSize], kDCTBlockSize * sizeof(block[0]));
         }
         ++block_ix;
       }
     }
-#ifdef HLS
     close(fdr);
   }
+#else
+  // The block rows are independent, so they are transformed in parallel.
+  ParallelFor(pool, mcu_rows_, [this, &rgb, w, h](int block_y) {
+    for (int block_x = 0; block_x < mcu_cols_; ++block_x) {
+      coeff_t block[3 * kDCTBlockSize];
+      RGBToYUVBlock(rgb, w, h, block_x, block_y, block);
+      const size_t block_ix = block_y * mcu_cols_ + block_x;
+      for (int i = 0; i < 3; ++i) {
+        ComputeBlockDCT(&block[i * kDCTBlockSize]);
+        memcpy(&coeffs_[i][block_ix * kDCTBlockSize],
+               &block[i * kDCTBlockSize], kDCTBlockSize * sizeof(block[0]));
+      }
+    }
+  });
 #endif // HLS
 
   return true;
 }
 
+bool DCTCoefficientCache::InitFromYUV(const std::vector<uint8_t>& yuv, int w,
+                                      int h, bool is_420, ThreadPool* pool) {
+  if (w < 0 || w >= 1 << 16 || h < 0 || h >= 1 << 16 ||
+      yuv.size() != YUVImageSize(w, h, is_420)) {
+    return false;
+  }
+  width_ = w;
+  height_ = h;
+  is_420_ = is_420;
+  const int mcu_size = is_420 ? 16 : 8;
+  mcu_cols_ = (w + mcu_size - 1) / mcu_size;
+  mcu_rows_ = (h + mcu_size - 1) / mcu_size;
+  const uint8_t* plane = yuv.data();
+  for (int i = 0; i < 3; ++i) {
+    const int subsampling = is_420 && i > 0 ? 2 : 1;
+    const int plane_w = (w + subsampling - 1) / subsampling;
+    const int plane_h = (h + subsampling - 1) / subsampling;
+    const int width_in_blocks = mcu_cols_ * SampFactor(i);
+    const int height_in_blocks = mcu_rows_ * SampFactor(i);
+    coeffs_[i].resize(static_cast<size_t>(width_in_blocks) *
+                      height_in_blocks * kDCTBlockSize);
+    coeff_t* out = coeffs_[i].data();
+    // The samples are already in the jpeg color space, so they go straight
+    // to the DCT, with the edge samples duplicated past the plane.
+    ParallelFor(pool, height_in_blocks, [=](int block_y) {
+      for (int block_x = 0; block_x < width_in_blocks; ++block_x) {
+        coeff_t* block =
+            &out[(block_y * width_in_blocks + block_x) * kDCTBlockSize];
+        for (int iy = 0; iy < 8; ++iy) {
+          const int y = std::min(plane_h - 1, 8 * block_y + iy);
+          for (int ix = 0; ix < 8; ++ix) {
+            const int x = std::min(plane_w - 1, 8 * block_x + ix);
+            block[8 * iy + ix] = plane[y * plane_w + x] - 128;
+          }
+        }
+        ComputeBlockDCT(block);
+      }
+    });
+    plane += plane_w * plane_h;
+  }
+  return true;
+}
+
+void DCTCoefficientCache::QuantizeAndCount(
+    const int* quant, ThreadPool* pool, JPEGData* jpg,
+    std::vector<JpegHistogram>* histograms) const {
+  int iquant[3 * kDCTBlockSize];
+  ComputeIQuant(quant, iquant);
+  // Each MCU row is quantized and counted on its own, and the rows are
+  // joined in order at the end.
+  std::vector<McuRowHistograms> rows(mcu_rows_);
+  ParallelFor(pool, mcu_rows_, [&](int mcu_y) {
+    McuRowHistograms* row = &rows[mcu_y];
+    for (int i = 0; i < 3; ++i) {
+      const int* iq = &iquant[i * kDCTBlockSize];
+      const int factor = SampFactor(i);
+      const int width_in_blocks = mcu_cols_ * factor;
+      coeff_t last_dc_coeff = 0;
+      // The blocks are visited in scan order, which is the order of the DC
+      // differences.
+      for (int mcu_x = 0; mcu_x < mcu_cols_; ++mcu_x) {
+        for (int iy = 0; iy < factor; ++iy) {
+          for (int ix = 0; ix < factor; ++ix) {
+            const int block_y = mcu_y * factor + iy;
+            const int block_x = mcu_x * factor + ix;
+            const size_t offset =
+                (block_y * width_in_blocks + block_x) * kDCTBlockSize;
+            coeff_t tmp[kDCTBlockSize];
+            coeff_t* block = jpg ? &jpg->components[i].coeffs[offset] : tmp;
+            QuantizeBlock(&coeffs_[i][offset], iq, block);
+            if (mcu_x == 0 && iy == 0 && ix == 0) {
+              row->first_dc[i] = block[0];
+            } else {
+              row->dc[i].Add(Log2Floor(std::abs(block[0] - last_dc_coeff)) +
+                             1);
+            }
+            last_dc_coeff = block[0];
+            UpdateACHistogramForDCTBlock(block, &row->ac[i]);
+          }
+        }
+      }
+      row->last_dc[i] = last_dc_coeff;
+    }
+  });
+  histograms->assign(6, JpegHistogram());
+  for (int i = 0; i < 3; ++i) {
+    JpegHistogram* dc_histogram = &(*histograms)[i];
+    JpegHistogram* ac_histogram = &(*histograms)[3 + i];
+    coeff_t last_dc_coeff = 0;
+    for (const McuRowHistograms& row : rows) {
+      dc_histogram->Add(Log2Floor(std::abs(row.first_dc[i] - last_dc_coeff)) +
+                        1);
+      dc_histogram->AddHistogram(row.dc[i]);
+      ac_histogram->AddHistogram(row.ac[i]);
+      last_dc_coeff = row.last_dc[i];
+    }
+  }
+}
+
+void DCTCoefficientCache::QuantizeBlocks(const int* quant, ThreadPool* pool,
+                                         JPEGData* jpg) const {
+  int iquant[3 * kDCTBlockSize];
+  ComputeIQuant(quant, iquant);
+  ParallelFor(pool, mcu_rows_, [&](int mcu_y) {
+    for (int i = 0; i < 3; ++i) {
+      const int* iq = &iquant[i * kDCTBlockSize];
+      const int factor = SampFactor(i);
+      // The blocks of an MCU row are consecutive in each component.
+      const size_t row_size =
+          static_cast<size_t>(mcu_cols_) * factor * factor * kDCTBlockSize;
+      coeff_t* out = &jpg->components[i].coeffs[0];
+      for (size_t offset = mcu_y * row_size; offset < (mcu_y + 1) * row_size;
+           offset += kDCTBlockSize) {
+        QuantizeBlock(&coeffs_[i][offset], iq, &out[offset]);
+      }
+    }
+  });
+}
+
+void DCTCoefficientCache::Quantize(const int* quant, JPEGData* jpg) const {
+  Quantize(quant, nullptr, jpg, nullptr);
+}
+
+void DCTCoefficientCache::Quantize(
+    const int* quant, ThreadPool* pool, JPEGData* jpg,
+    std::vector<JpegHistogram>* histograms) const {
+  *jpg = JPEGData();
+  if (is_420_) {
+    InitJPEGDataForYUV420(width_, height_, jpg);
+  } else {
+    InitJPEGDataForYUV444(width_, height_, jpg);
+  }
+  AddApp0Data(jpg);
+  for (int i = 0; i < 3; ++i) {
+    JPEGQuantTable* table = &jpg->quant[i];
+    // Each component has its own table, which the DQT and SOF markers refer
+    // to by its index.
+    table->index = i;
+    for (int j = 0; j < kDCTBlockSize; ++j) {
+      table->values[j] = quant[i * kDCTBlockSize + j];
+      if (table->values[j] > 0xff) table->precision = 1;
+    }
+  }
+  if (histograms) {
+    QuantizeAndCount(quant, pool, jpg, histograms);
+  } else {
+    QuantizeBlocks(quant, pool, jpg);
+  }
+}
+
+size_t DCTCoefficientCache::EstimateJpegSize(const int* quant) const {
+  return EstimateJpegSize(quant, nullptr);
+}
+
+size_t DCTCoefficientCache::EstimateJpegSize(const int* quant,
+                                             ThreadPool* pool) const {
+  std::vector<JpegHistogram> histograms;
+  QuantizeAndCount(quant, pool, nullptr, &histograms);
+  // Everything but the entropy coded data and the Huffman codes only depends
+  // on the number of components and the precision of the quant tables.
+  JPEGData header;
+  AddApp0Data(&header);
+  header.components.resize(3);
+  header.quant.resize(3);
+  for (int i = 0; i < 3 * kDCTBlockSize; ++i) {
+    if (quant[i] > 0xff) header.quant[i / kDCTBlockSize].precision = 1;
+  }
+  return JpegHeaderSize(header, true) + EstimateJpegDataSize(3, histograms);
+}
+
+namespace {
+
+// The quant tables of the jpegs that keep the full precision of the DCT.
+static const int kUnitQuant[3 * kDCTBlockSize] = {
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+bool EncodeWithCache(const std::vector<uint8_t>& rgb, int w, int h,
+                     const int* quant, ThreadPool* pool, JPEGData* jpg) {
+  DCTCoefficientCache cache;
+  if (!cache.Init(rgb, w, h, pool)) {
+    return false;
+  }
+  cache.Quantize(quant, pool, jpg, nullptr);
+  return true;
+}
+
+}  // namespace
+
+bool EncodeRGBToJpeg(const std::vector<uint8_t>& rgb, int w, int h,
+                     const int* quant, JPEGData* jpg) {
+  return EncodeWithCache(rgb, w, h, quant, nullptr, jpg);
+}
+
 bool EncodeRGBToJpeg(const std::vector<uint8_t>& rgb, int w, int h,
                      JPEGData* jpg) {
-  static const int quant[3 * kDCTBlockSize] = {
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-  };
-  return EncodeRGBToJpeg(rgb, w, h, quant, jpg);
+  return EncodeRGBToJpeg(rgb, w, h, static_cast<ThreadPool*>(nullptr), jpg);
+}
+
+bool EncodeRGBToJpeg(const std::vector<uint8_t>& rgb, int w, int h,
+                     ThreadPool* pool, JPEGData* jpg) {
+  return EncodeWithCache(rgb, w, h, kUnitQuant, pool, jpg);
+}
+
+size_t YUVImageSize(int w, int h, bool is_420) {
+  const size_t luma_size = static_cast<size_t>(w) * h;
+  if (!is_420) {
+    return 3 * luma_size;
+  }
+  return luma_size + 2 * static_cast<size_t>((w + 1) / 2) * ((h + 1) / 2);
+}
+
+bool EncodeYUVToJpeg(const std::vector<uint8_t>& yuv, int w, int h,
+                     bool is_420, ThreadPool* pool, JPEGData* jpg) {
+  DCTCoefficientCache cache;
+  if (!cache.InitFromYUV(yuv, w, h, is_420, pool)) {
+    return false;
+  }
+  cache.Quantize(kUnitQuant, pool, jpg, nullptr);
+  return true;
 }
 
 }  // namespace guetzli
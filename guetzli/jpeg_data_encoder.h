@@ -17,12 +17,75 @@
 #ifndef GUETZLI_JPEG_DATA_ENCODER_H_
 #define GUETZLI_JPEG_DATA_ENCODER_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <vector>
 
 #include "guetzli/jpeg_data.h"
+#include "guetzli/jpeg_data_writer.h"
 
 namespace guetzli {
 
+class ThreadPool;
+
+// The unquantized DCT coefficients of an rgb or YCbCr image, from which jpegs
+// with any set of quantization tables can be created without redoing the
+// color conversion and the DCT.
+class DCTCoefficientCache {
+ public:
+  // Computes the DCT coefficients of the rgb pixel data. Returns true on
+  // success.
+  bool Init(const std::vector<uint8_t>& rgb, int w, int h);
+  // Same as above, but transforms the block rows in parallel on pool, which
+  // may be null.
+  bool Init(const std::vector<uint8_t>& rgb, int w, int h, ThreadPool* pool);
+
+  // Computes the DCT coefficients of the planar YCbCr image in yuv, see
+  // YUVImageSize(), skipping the color conversion. The jpegs have 4:2:0
+  // chroma subsampling if is_420 is set. Returns true on success.
+  bool InitFromYUV(const std::vector<uint8_t>& yuv, int w, int h, bool is_420,
+                   ThreadPool* pool);
+
+  // Fills in *jpg with the coefficients quantized with the given quantization
+  // table of 3 * kDCTBlockSize values.
+  void Quantize(const int* quant, JPEGData* jpg) const;
+  // Same as above, but quantizes the block rows in parallel on pool, and also
+  // sets *histograms to the DC histograms of the three components followed by
+  // their AC histograms, as WriteJpegWithHistograms() takes them, unless it
+  // is null.
+  void Quantize(const int* quant, ThreadPool* pool, JPEGData* jpg,
+                std::vector<JpegHistogram>* histograms) const;
+
+  // Returns the estimated size in bytes of the sequential jpeg that
+  // Quantize(quant) would create, computed from the symbol histograms of the
+  // quantized coefficients.
+  size_t EstimateJpegSize(const int* quant) const;
+  size_t EstimateJpegSize(const int* quant, ThreadPool* pool) const;
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+ private:
+  // Quantizes the coefficients one block row at a time on pool, writing them
+  // to *jpg if it is not null, and computes the symbol histograms of each row,
+  // which are then merged in row order.
+  void QuantizeAndCount(const int* quant, ThreadPool* pool, JPEGData* jpg,
+                        std::vector<JpegHistogram>* histograms) const;
+  // Same as above, without the histograms.
+  void QuantizeBlocks(const int* quant, ThreadPool* pool, JPEGData* jpg) const;
+
+  // The number of blocks per MCU in each direction in component c.
+  int SampFactor(int c) const { return is_420_ && c == 0 ? 2 : 1; }
+
+  int width_ = 0;
+  int height_ = 0;
+  bool is_420_ = false;
+  int mcu_cols_ = 0;
+  int mcu_rows_ = 0;
+  // The DCT coefficients of each component, upscaled by 16, in the block
+  // order of JPEGComponent::coeffs.
+  std::vector<coeff_t> coeffs_[3];
+};
 
 // Adds APP0 header data.
 void AddApp0Data(JPEGData* jpg);
@@ -30,12 +93,27 @@ void AddApp0Data(JPEGData* jpg);
 // Creates a JPEG from the rgb pixel data. Returns true on success.
 bool EncodeRGBToJpeg(const std::vector<uint8_t>& rgb, int w, int h,
                      JPEGData* jpg);
+// Same as above, but runs the color conversion, the DCT and the quantization
+// in parallel on pool, which may be null.
+bool EncodeRGBToJpeg(const std::vector<uint8_t>& rgb, int w, int h,
+                     ThreadPool* pool, JPEGData* jpg);
 
 // Creates a JPEG from the rgb pixel data. Returns true on success. The given
 // quantization table must have 3 * kDCTBlockSize values.
 bool EncodeRGBToJpeg(const std::vector<uint8_t>& rgb, int w, int h,
                      const int* quant, JPEGData* jpg);
 
+// Returns the size in bytes of a planar YCbCr image: the w x h Y plane
+// followed by the Cb and Cr planes, which are (w + 1) / 2 x (h + 1) / 2 if
+// is_420 is set and w x h otherwise. The samples are full range, as in JFIF.
+size_t YUVImageSize(int w, int h, bool is_420);
+
+// Creates a JPEG from the planar YCbCr image in yuv, see YUVImageSize(). The
+// samples go to the DCT without a color conversion, and the JPEG has 4:2:0
+// chroma subsampling if is_420 is set. Returns true on success.
+bool EncodeYUVToJpeg(const std::vector<uint8_t>& yuv, int w, int h,
+                     bool is_420, ThreadPool* pool, JPEGData* jpg);
+
 }  // namespace guetzli
 
 #endif  // GUETZLI_JPEG_DATA_ENCODER_H_
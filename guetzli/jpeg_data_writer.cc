@@ -16,9 +16,12 @@
 
 #include "guetzli/jpeg_data_writer.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <cstdlib>
 #include <string.h>
+#include <utility>
+#include <vector>
 
 #include "guetzli/entropy_encode.h"
 #include "guetzli/fast_log.h"
@@ -99,13 +102,13 @@ bool EncodeDQT(const std::vector<JPEGQuantTable>& quant, JPEGOutput out) {
   return JPEGWrite(out, &data[0], pos);
 }
 
-bool EncodeSOF(const JPEGData& jpg, JPEGOutput out) {
+bool EncodeSOF(const JPEGData& jpg, bool progressive, JPEGOutput out) {
   const size_t ncomps = jpg.components.size();
   const size_t marker_len = 8 + 3 * ncomps;
   std::vector<uint8_t> data(marker_len + 2);
   size_t pos = 0;
   data[pos++] = 0xff;
-  data[pos++] = 0xc1;
+  data[pos++] = progressive ? 0xc2 : 0xc1;
   data[pos++] = static_cast<uint8_t>(marker_len >> 8);
   data[pos++] = marker_len & 0xff;
   data[pos++] = kJpegPrecision;
@@ -357,29 +360,27 @@ size_t EstimateJpegDataSize(const int num_components,
 namespace {
 
 // Writes DHT and SOS marker segments to out and fills in DC/AC Huffman tables
-// for each component of the image.
-bool BuildAndEncodeHuffmanCodes(const JPEGData& jpg, JPEGOutput out,
-                                std::vector<HuffmanCodeTable>* dc_huff_tables,
-                                std::vector<HuffmanCodeTable>* ac_huff_tables) {
+// for each component of the image, given the DC histograms of the components
+// followed by their AC histograms.
+bool EncodeHuffmanCodes(const JPEGData& jpg,
+                        std::vector<JpegHistogram> histograms, JPEGOutput out,
+                        std::vector<HuffmanCodeTable>* dc_huff_tables,
+                        std::vector<HuffmanCodeTable>* ac_huff_tables) {
   const int ncomps = jpg.components.size();
+  assert(histograms.size() == 2 * jpg.components.size());
   dc_huff_tables->resize(ncomps);
   ac_huff_tables->resize(ncomps);
 
-  // Build separate DC histograms for each component.
-  std::vector<JpegHistogram> histograms(ncomps);
-  BuildDCHistograms(jpg, &histograms[0]);
-
   // Cluster DC histograms.
   size_t num_dc_histo = ncomps;
   int dc_histo_indexes[kMaxComponents];
-  std::vector<uint8_t> depths(ncomps * JpegHistogram::kSize);
+  std::vector<uint8_t> depths(2 * ncomps * JpegHistogram::kSize);
   ClusterHistograms(&histograms[0], &num_dc_histo, dc_histo_indexes,
                     &depths[0]);
 
-  // Build separate AC histograms for each component.
-  histograms.resize(num_dc_histo + ncomps);
-  depths.resize((num_dc_histo + ncomps) * JpegHistogram::kSize);
-  BuildACHistograms(jpg, &histograms[num_dc_histo]);
+  // Move the AC histograms right after the clustered DC histograms.
+  std::copy(histograms.begin() + ncomps, histograms.end(),
+            histograms.begin() + num_dc_histo);
 
   // Cluster AC histograms.
   size_t num_ac_histo = ncomps;
@@ -452,6 +453,19 @@ bool BuildAndEncodeHuffmanCodes(const JPEGData& jpg, JPEGOutput out,
   return JPEGWrite(out, &data[0], data.size());
 }
 
+// Same as EncodeHuffmanCodes(), but computes the histograms from the
+// coefficients of jpg.
+bool BuildAndEncodeHuffmanCodes(const JPEGData& jpg, JPEGOutput out,
+                                std::vector<HuffmanCodeTable>* dc_huff_tables,
+                                std::vector<HuffmanCodeTable>* ac_huff_tables) {
+  const int ncomps = jpg.components.size();
+  std::vector<JpegHistogram> histograms(2 * ncomps);
+  BuildDCHistograms(jpg, &histograms[0]);
+  BuildACHistograms(jpg, &histograms[ncomps]);
+  return EncodeHuffmanCodes(jpg, std::move(histograms), out, dc_huff_tables,
+                            ac_huff_tables);
+}
+
 void EncodeDCTBlockSequential(const coeff_t* coeffs,
                               const HuffmanCodeTable& dc_huff,
                               const HuffmanCodeTable& ac_huff,
@@ -535,6 +549,247 @@ bool EncodeScan(const JPEGData& jpg,
   return !bw.overflow && JPEGWrite(out, bw.data.get(), bw.pos);
 }
 
+// Component indexes and spectral band of one scan of a progressive jpeg.
+// Successive approximation is not used.
+struct ProgressiveScan {
+  int num_comps;
+  int comps[kMaxComponents];
+  int Ss;
+  int Se;
+};
+
+// The DC coefficients of all components in one interleaved scan, followed by
+// the low and high frequency AC coefficients of the first component in two
+// scans, and the AC coefficients of the other components in one scan each.
+std::vector<ProgressiveScan> ProgressiveScanScript(const JPEGData& jpg) {
+  const int ncomps = jpg.components.size();
+  std::vector<ProgressiveScan> scans;
+  ProgressiveScan dc = { ncomps, { 0 }, 0, 0 };
+  for (int i = 0; i < ncomps; ++i) dc.comps[i] = i;
+  scans.push_back(dc);
+  const ProgressiveScan first_ac = { 1, { 0 }, 1, 5 };
+  scans.push_back(first_ac);
+  for (int i = 1; i < ncomps; ++i) {
+    const ProgressiveScan ac = { 1, { i }, 1, 63 };
+    scans.push_back(ac);
+  }
+  const ProgressiveScan last_ac = { 1, { 0 }, 6, 63 };
+  scans.push_back(last_ac);
+  return scans;
+}
+
+// Collects the symbols of a scan into one histogram per Huffman table.
+struct HistogramSink {
+  explicit HistogramSink(JpegHistogram* histograms)
+      : histograms(histograms) {}
+  void Symbol(int table, int symbol) { histograms[table].Add(symbol); }
+  void Bits(int, int) {}
+  bool Flush() { return true; }
+
+  JpegHistogram* histograms;
+};
+
+// Writes the Huffman coded symbols of a scan to out.
+struct BitWriterSink {
+  BitWriterSink(const HuffmanCodeTable* tables, JPEGOutput out)
+      : tables(tables), out(out), bw(1 << 17) {}
+  void Symbol(int table, int symbol) {
+    bw.WriteBits(tables[table].depth[symbol], tables[table].code[symbol]);
+  }
+  void Bits(int nbits, int bits) {
+    if (nbits > 0) bw.WriteBits(nbits, bits & ((1 << nbits) - 1));
+  }
+  bool Flush() {
+    if (bw.pos > (1 << 16)) {
+      if (!JPEGWrite(out, bw.data.get(), bw.pos)) {
+        return false;
+      }
+      bw.pos = 0;
+    }
+    return true;
+  }
+  bool Finish() {
+    bw.JumpToByteBoundary();
+    return !bw.overflow && JPEGWrite(out, bw.data.get(), bw.pos);
+  }
+
+  const HuffmanCodeTable* tables;
+  JPEGOutput out;
+  BitWriter bw;
+};
+
+template <class Sink>
+void EncodeDCDiff(coeff_t dc_coeff, coeff_t* last_dc_coeff, int table,
+                  Sink* sink) {
+  int diff = dc_coeff - *last_dc_coeff;
+  *last_dc_coeff = dc_coeff;
+  const int nbits = Log2Floor(std::abs(diff)) + 1;
+  sink->Symbol(table, nbits);
+  sink->Bits(nbits, diff < 0 ? diff - 1 : diff);
+}
+
+template <class Sink>
+void EncodeEOBRun(int* eobrun, Sink* sink) {
+  if (*eobrun == 0) return;
+  const int nbits = Log2FloorNonZero(*eobrun);
+  sink->Symbol(0, nbits << 4);
+  sink->Bits(nbits, *eobrun);
+  *eobrun = 0;
+}
+
+// Codes the coefficients Ss..Se of a block in an AC first scan without
+// successive approximation. Blocks that end with zeros are collected into
+// end-of-band runs.
+template <class Sink>
+void EncodeACBand(const coeff_t* coeffs, int Ss, int Se, int* eobrun,
+                  Sink* sink) {
+  static const int kMaxEOBRun = 0x7fff;
+  int r = 0;
+  for (int k = Ss; k <= Se; ++k) {
+    const int coeff = coeffs[kJPEGNaturalOrder[k]];
+    if (coeff == 0) {
+      r++;
+      continue;
+    }
+    EncodeEOBRun(eobrun, sink);
+    while (r > 15) {
+      sink->Symbol(0, 0xf0);
+      r -= 16;
+    }
+    const int nbits = Log2FloorNonZero(std::abs(coeff)) + 1;
+    sink->Symbol(0, (r << 4) + nbits);
+    sink->Bits(nbits, coeff < 0 ? coeff - 1 : coeff);
+    r = 0;
+  }
+  if (r > 0 && ++(*eobrun) == kMaxEOBRun) {
+    EncodeEOBRun(eobrun, sink);
+  }
+}
+
+// Sends the symbols of the scan to sink, in coding order.
+template <class Sink>
+bool EncodeProgressiveScan(const JPEGData& jpg, const ProgressiveScan& scan,
+                           Sink* sink) {
+  if (scan.num_comps > 1) {
+    // Interleaved scans are DC only and go over the blocks in MCU order.
+    coeff_t last_dc_coeff[kMaxComponents] = { 0 };
+    for (int mcu_y = 0; mcu_y < jpg.MCU_rows; ++mcu_y) {
+      for (int mcu_x = 0; mcu_x < jpg.MCU_cols; ++mcu_x) {
+        for (int i = 0; i < scan.num_comps; ++i) {
+          const JPEGComponent& c = jpg.components[scan.comps[i]];
+          for (int iy = 0; iy < c.v_samp_factor; ++iy) {
+            for (int ix = 0; ix < c.h_samp_factor; ++ix) {
+              int block_y = mcu_y * c.v_samp_factor + iy;
+              int block_x = mcu_x * c.h_samp_factor + ix;
+              int block_idx = block_y * c.width_in_blocks + block_x;
+              EncodeDCDiff(c.coeffs[block_idx << 6], &last_dc_coeff[i], i,
+                           sink);
+            }
+          }
+        }
+        // Flushing once per MCU, like EncodeScan(), keeps the bits of a row
+        // of any width from overflowing the buffer.
+        if (!sink->Flush()) return false;
+      }
+    }
+    return true;
+  }
+  // Non-interleaved scans only cover the blocks that intersect the image.
+  const JPEGComponent& c = jpg.components[scan.comps[0]];
+  const int xsize = (jpg.width * c.h_samp_factor + jpg.max_h_samp_factor - 1) /
+      jpg.max_h_samp_factor;
+  const int ysize = (jpg.height * c.v_samp_factor + jpg.max_v_samp_factor - 1) /
+      jpg.max_v_samp_factor;
+  const int xsize_blocks = (xsize + 7) / 8;
+  const int ysize_blocks = (ysize + 7) / 8;
+  coeff_t last_dc_coeff = 0;
+  int eobrun = 0;
+  for (int block_y = 0; block_y < ysize_blocks; ++block_y) {
+    for (int block_x = 0; block_x < xsize_blocks; ++block_x) {
+      int block_idx = block_y * c.width_in_blocks + block_x;
+      const coeff_t* coeffs = &c.coeffs[block_idx << 6];
+      if (scan.Ss == 0) {
+        EncodeDCDiff(coeffs[0], &last_dc_coeff, 0, sink);
+      } else {
+        EncodeACBand(coeffs, scan.Ss, scan.Se, &eobrun, sink);
+      }
+      if (!sink->Flush()) return false;
+    }
+  }
+  EncodeEOBRun(&eobrun, sink);
+  return true;
+}
+
+// Builds optimal Huffman codes for the symbols of the scan, then writes the
+// DHT and SOS marker segments and the entropy coded data of the scan.
+bool EncodeProgressiveScanWithHuffmanCodes(const JPEGData& jpg,
+                                           const ProgressiveScan& scan,
+                                           JPEGOutput out) {
+  const bool is_dc = scan.Ss == 0;
+  const int num_tables = is_dc ? scan.num_comps : 1;
+  JpegHistogram histograms[kMaxComponents];
+  HistogramSink histogram_sink(histograms);
+  EncodeProgressiveScan(jpg, scan, &histogram_sink);
+
+  HuffmanCodeTable tables[kMaxComponents];
+  std::vector<uint8_t> data(4);
+  data[0] = 0xff;
+  data[1] = 0xc4;
+  for (int i = 0; i < num_tables; ++i) {
+    std::vector<HuffmanTree> tree(2 * JpegHistogram::kSize + 1);
+    uint8_t depth[JpegHistogram::kSize] = { 0 };
+    CreateHuffmanTree(histograms[i].counts, JpegHistogram::kSize,
+                      kJpegHuffmanMaxBitLength, &tree[0], depth);
+    int counts[kJpegHuffmanMaxBitLength + 1] = { 0 };
+    int values[JpegHistogram::kSize] = { 0 };
+    BuildHuffmanCode(depth, counts, values);
+    for (int j = 0; j < 256; ++j) tables[i].depth[j] = 255;
+    BuildHuffmanCodeTable(counts, values, &tables[i]);
+    // Remove the fake symbol with the all 1 code.
+    int max_length = kJpegHuffmanMaxBitLength;
+    while (max_length > 0 && counts[max_length] == 0) --max_length;
+    --counts[max_length];
+    int total_count = 0;
+    for (int j = 0; j <= max_length; ++j) total_count += counts[j];
+    data.push_back(is_dc ? i : 0x10);
+    for (int j = 1; j <= kJpegHuffmanMaxBitLength; ++j) {
+      data.push_back(counts[j]);
+    }
+    data.insert(data.end(), values, values + total_count);
+  }
+  const size_t dht_marker_len = data.size() - 2;
+  data[2] = static_cast<uint8_t>(dht_marker_len >> 8);
+  data[3] = dht_marker_len & 0xff;
+
+  const size_t sos_marker_len = 6 + 2 * scan.num_comps;
+  data.push_back(0xff);
+  data.push_back(0xda);
+  data.push_back(static_cast<uint8_t>(sos_marker_len >> 8));
+  data.push_back(sos_marker_len & 0xff);
+  data.push_back(scan.num_comps);
+  for (int i = 0; i < scan.num_comps; ++i) {
+    data.push_back(jpg.components[scan.comps[i]].id);
+    data.push_back(is_dc ? (i << 4) : 0);
+  }
+  data.push_back(scan.Ss);
+  data.push_back(scan.Se);
+  data.push_back(0);
+  if (!JPEGWrite(out, &data[0], data.size())) {
+    return false;
+  }
+  BitWriterSink bit_sink(tables, out);
+  return EncodeProgressiveScan(jpg, scan, &bit_sink) && bit_sink.Finish();
+}
+
+bool EncodeProgressiveScans(const JPEGData& jpg, JPEGOutput out) {
+  for (const ProgressiveScan& scan : ProgressiveScanScript(jpg)) {
+    if (!EncodeProgressiveScanWithHuffmanCodes(jpg, scan, out)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 }  // namespace
 
 bool WriteJpeg(const JPEGData& jpg, bool strip_metadata, JPEGOutput out) {
@@ -545,13 +800,43 @@ bool WriteJpeg(const JPEGData& jpg, bool strip_metadata, JPEGOutput out) {
   return (JPEGWrite(out, kSOIMarker, sizeof(kSOIMarker)) &&
           EncodeMetadata(jpg, strip_metadata, out) &&
           EncodeDQT(jpg.quant, out) &&
-          EncodeSOF(jpg, out) &&
+          EncodeSOF(jpg, false, out) &&
           BuildAndEncodeHuffmanCodes(jpg, out, &dc_codes, &ac_codes) &&
           EncodeScan(jpg, dc_codes, ac_codes, out) &&
           JPEGWrite(out, kEOIMarker, sizeof(kEOIMarker)) &&
           (strip_metadata || JPEGWrite(out, jpg.tail_data)));
 }
 
+bool WriteJpegWithHistograms(const JPEGData& jpg, bool strip_metadata,
+                             const std::vector<JpegHistogram>& histograms,
+                             JPEGOutput out) {
+  static const uint8_t kSOIMarker[2] = { 0xff, 0xd8 };
+  static const uint8_t kEOIMarker[2] = { 0xff, 0xd9 };
+  std::vector<HuffmanCodeTable> dc_codes;
+  std::vector<HuffmanCodeTable> ac_codes;
+  return (JPEGWrite(out, kSOIMarker, sizeof(kSOIMarker)) &&
+          EncodeMetadata(jpg, strip_metadata, out) &&
+          EncodeDQT(jpg.quant, out) &&
+          EncodeSOF(jpg, false, out) &&
+          EncodeHuffmanCodes(jpg, histograms, out, &dc_codes, &ac_codes) &&
+          EncodeScan(jpg, dc_codes, ac_codes, out) &&
+          JPEGWrite(out, kEOIMarker, sizeof(kEOIMarker)) &&
+          (strip_metadata || JPEGWrite(out, jpg.tail_data)));
+}
+
+bool WriteProgressiveJpeg(const JPEGData& jpg, bool strip_metadata,
+                          JPEGOutput out) {
+  static const uint8_t kSOIMarker[2] = { 0xff, 0xd8 };
+  static const uint8_t kEOIMarker[2] = { 0xff, 0xd9 };
+  return (JPEGWrite(out, kSOIMarker, sizeof(kSOIMarker)) &&
+          EncodeMetadata(jpg, strip_metadata, out) &&
+          EncodeDQT(jpg.quant, out) &&
+          EncodeSOF(jpg, true, out) &&
+          EncodeProgressiveScans(jpg, out) &&
+          JPEGWrite(out, kEOIMarker, sizeof(kEOIMarker)) &&
+          (strip_metadata || JPEGWrite(out, jpg.tail_data)));
+}
+
 int NullOut(void* data, const uint8_t* buf, size_t count) {
   return count;
 }
@@ -44,6 +44,12 @@ struct JPEGOutput {
 
 bool WriteJpeg(const JPEGData& jpg, bool strip_metadata, JPEGOutput out);
 
+// Same as WriteJpeg(), but writes a progressive jpeg: a DC scan of all
+// components followed by spectral selection AC scans, each with its own
+// optimal Huffman codes.
+bool WriteProgressiveJpeg(const JPEGData& jpg, bool strip_metadata,
+                          JPEGOutput out);
+
 struct HuffmanCodeTable {
   uint8_t depth[256];
   int code[256];
@@ -84,6 +90,14 @@ struct JpegHistogram {
   uint32_t counts[kSize];
 };
 
+// Same as WriteJpeg(), but builds the Huffman codes from the given DC
+// histograms of the components followed by their AC histograms instead of
+// counting the symbols of jpg, so that the coefficients are only read once
+// more to emit the bits.
+bool WriteJpegWithHistograms(const JPEGData& jpg, bool strip_metadata,
+                             const std::vector<JpegHistogram>& histograms,
+                             JPEGOutput out);
+
 void BuildDCHistograms(const JPEGData& jpg, JpegHistogram* histo);
 void BuildACHistograms(const JPEGData& jpg, JpegHistogram* histo);
 size_t JpegHeaderSize(const JPEGData& jpg, bool strip_metadata);
@@ -29,6 +29,11 @@
 #include "guetzli/gamma_correct.h"
 #include "guetzli/preprocess_downsample.h"
 #include "guetzli/quantize.h"
+#include "guetzli/upsample.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
 
 namespace guetzli {
 
@@ -46,6 +51,30 @@ void OutputImageComponent::Reset(int factor_x, int factor_y) {
   coeffs_ = std::vector<coeff_t>(num_blocks_ * kDCTBlockSize);
   pixels_ = std::vector<uint16_t>(width_ * height_, 128 << 4);
   for (int i = 0; i < kDCTBlockSize; ++i) quant_[i] = 1;
+  dirty_.assign(((width_ + 7) / 8) * ((height_ + 7) / 8), 0);
+  dirty_list_.clear();
+  MarkDirty(0, 0, width_ - 1, height_ - 1);
+}
+
+void OutputImageComponent::MarkDirty(int xmin, int ymin, int xmax, int ymax) {
+  if (xmin > xmax || ymin > ymax) return;
+  const int stride = (width_ + 7) / 8;
+  for (int by = ymin / 8; by <= ymax / 8; ++by) {
+    for (int bx = xmin / 8; bx <= xmax / 8; ++bx) {
+      const int idx = by * stride + bx;
+      if (!dirty_[idx]) {
+        dirty_[idx] = 1;
+        dirty_list_.push_back(idx);
+      }
+    }
+  }
+}
+
+void OutputImageComponent::ClearDirtyBlocks() {
+  for (int idx : dirty_list_) {
+    dirty_[idx] = 0;
+  }
+  dirty_list_.clear();
 }
 
 bool OutputImageComponent::IsAllZero() const {
@@ -143,6 +172,9 @@ void OutputImageComponent::UpdatePixelsForBlock(
         pixels_[p] = idct[8 * iy + ix] << 4;
       }
     }
+    MarkDirty(8 * block_x, 8 * block_y,
+              std::min(8 * block_x + 7, width_ - 1),
+              std::min(8 * block_y + 7, height_ - 1));
   } else if (factor_x_ == 2 && factor_y_ == 2) {
     // Fill in the 10x10 pixel area in the subsampled image that will be the
     // basis of the upsampling. This area is enough to hold the 3x3 kernel of
@@ -201,6 +233,7 @@ void OutputImageComponent::UpdatePixelsForBlock(
                      subsampled[ix + dx] * 3 + subsampled[ix + dx + dy]) >> 4;
       }
     }
+    MarkDirty(xmin, ymin, xmax, ymax);
   } else {
     printf("Sampling ratio not supported: factor_x = %d factor_y = %d\n",
            factor_x_, factor_y_);
@@ -214,6 +247,15 @@ void OutputImageComponent::CopyFromJpegComponent(const JPEGComponent& comp,
   Reset(factor_x, factor_y);
   assert(width_in_blocks_ <= comp.width_in_blocks);
   assert(height_in_blocks_ <= comp.height_in_blocks);
+  const bool upsample = factor_x_ == 2 && factor_y_ == 2;
+  // For 2x2 subsampled components, the IDCT of all blocks is collected in a
+  // subsampled image first, which is then upsampled in one pass. Doing it per
+  // block would reconstruct the edges of each block from its neighbours.
+  const int sub_stride = 8 * width_in_blocks_;
+  std::vector<uint8_t> subsampled;
+  if (upsample) {
+    subsampled.resize(sub_stride * 8 * height_in_blocks_);
+  }
   const size_t src_row_size = comp.width_in_blocks * kDCTBlockSize;
   for (int block_y = 0; block_y < height_in_blocks_; ++block_y) {
     const coeff_t* src_coeffs = &comp.coeffs[block_y * src_row_size];
@@ -222,10 +264,33 @@ void OutputImageComponent::CopyFromJpegComponent(const JPEGComponent& comp,
       for (int i = 0; i < kDCTBlockSize; ++i) {
         block[i] = src_coeffs[i] * quant[i];
       }
-      SetCoeffBlock(block_x, block_y, block);
+      if (upsample) {
+        const int offset = (block_y * width_in_blocks_ + block_x) *
+            kDCTBlockSize;
+        memcpy(&coeffs_[offset], block, kDCTBlockSize * sizeof(coeffs_[0]));
+        uint8_t idct[kDCTBlockSize];
+        ComputeBlockIDCT(block, idct);
+        for (int iy = 0; iy < 8; ++iy) {
+          memcpy(&subsampled[(8 * block_y + iy) * sub_stride + 8 * block_x],
+                 &idct[8 * iy], 8);
+        }
+      } else {
+        SetCoeffBlock(block_x, block_y, block);
+      }
       src_coeffs += kDCTBlockSize;
     }
   }
+  if (upsample) {
+    const int sub_width = (width_ + 1) / 2;
+    const int sub_height = (height_ + 1) / 2;
+    for (int y = 0; y < height_; ++y) {
+      const int j = y >> 1;
+      const int j1 = std::min(sub_height - 1, std::max(0, j + 2 * (y & 1) - 1));
+      FancyUpsampleRow(&subsampled[j * sub_stride],
+                       &subsampled[j1 * sub_stride], sub_width, width_,
+                       &pixels_[y * width_]);
+    }
+  }
   memcpy(quant_, quant, sizeof(quant_));
 }
 
@@ -288,6 +353,62 @@ void SetDownsampledCoefficients(const std::vector<float>& pixels,
 
 }  // namespace
 
+void OutputImage::Downsample(const DownsampleConfig& cfg, ThreadPool* pool) {
+  if (components_[1].IsAllZero() && components_[2].IsAllZero()) {
+    // If the image is already grayscale, nothing to do.
+    return;
+  }
+  if (cfg.use_silver_screen &&
+      cfg.u_factor_x == 2 && cfg.u_factor_y == 2 &&
+      cfg.v_factor_x == 2 && cfg.v_factor_y == 2) {
+    std::vector<uint8_t> rgb = ToSRGB();
+    std::vector<std::vector<float> > yuv =
+        RGBToYUV420(rgb, width_, height_, pool);
+    SetDownsampledCoefficients(yuv[1], 2, 2, &components_[1]);
+    SetDownsampledCoefficients(yuv[2], 2, 2, &components_[2]);
+    return;
+  }
+  // Get the floating-point precision YUV array represented by the set of
+  // DCT coefficients.
+  std::vector<std::vector<float> > yuv(3, std::vector<float>(width_ * height_));
+  for (int c = 0; c < 3; ++c) {
+    components_[c].ToFloatPixels(&yuv[c][0], 1);
+  }
+  yuv = PreProcessChannel(width_, height_, 1, 1.3f, 0.5f,
+                          cfg.u_blur, cfg.u_sharpen, yuv, pool);
+  yuv = PreProcessChannel(width_, height_, 2, 1.3f, 0.5f,
+                          cfg.v_blur, cfg.v_sharpen, yuv, pool);
+  // Do the actual downsampling (averaging) and forward-DCT.
+  if (cfg.u_factor_x != 1 || cfg.u_factor_y != 1) {
+    SetDownsampledCoefficients(yuv[1], cfg.u_factor_x, cfg.u_factor_y,
+                               &components_[1]);
+  }
+  if (cfg.v_factor_x != 1 || cfg.v_factor_y != 1) {
+    SetDownsampledCoefficients(yuv[2], cfg.v_factor_x, cfg.v_factor_y,
+                               &components_[2]);
+  }
+}
+
+void OutputImageComponent::ApplyGlobalQuantization(
+    const int q[kDCTBlockSize]) {
+  for (int block_y = 0; block_y < height_in_blocks_; ++block_y) {
+    for (int block_x = 0; block_x < width_in_blocks_; ++block_x) {
+      coeff_t block[kDCTBlockSize];
+      GetCoeffBlock(block_x, block_y, block);
+      if (QuantizeBlock(block, q)) {
+        SetCoeffBlock(block_x, block_y, block);
+      }
+    }
+  }
+  memcpy(quant_, q, sizeof(quant_));
+}
+
+void OutputImage::ApplyGlobalQuantization(const int q[3][kDCTBlockSize]) {
+  for (int c = 0; c < 3; ++c) {
+    components_[c].ApplyGlobalQuantization(&q[c][0]);
+  }
+}
+
 void OutputImage::SaveToJpegData(JPEGData* jpg) const {
   assert(components_[0].factor_x() == 1);
   assert(components_[0].factor_y() == 1);
@@ -351,14 +472,115 @@ void OutputImage::SaveToJpegData(JPEGData* jpg) const {
   SaveQuantTables(q, jpg);
 }
 
+namespace {
+
+// Converts the n pixels starting at column x of the given rows of upscaled
+// Y, Cb and Cr values (see OutputImageComponent::ToPixels()) to interleaved
+// RGB. The result is the same as that of ColorTransformYCbCrToRGB().
+void YCbCrRowToRGB(const uint16_t* y_row, const uint16_t* cb_row,
+                   const uint16_t* cr_row, int x, int n, uint8_t* out) {
+  int i = 0;
+#ifdef __SSE2__
+  // The color transform tables are, with c' = c - 128:
+  //   kCrToRedTable[cr] = (91881 * cr' + 32768) >> 16
+  //   kCbToBlueTable[cb] = (116130 * cb' + 32768) >> 16
+  //   (kCrToGreenTable[cr] + kCbToGreenTable[cb]) >> 16 =
+  //       (-22554 * cb' - 46802 * cr' + 32768) >> 16
+  // The multipliers are split into a multiple of 65536 and a part that fits
+  // into 16 bits, so that the products can be computed with pmaddwd.
+  const __m128i round_bias = _mm_set1_epi32(32768);
+  const __m128i center = _mm_set1_epi16(128);
+  const __m128i cr_to_red = _mm_set1_epi32(26345);
+  const __m128i cb_to_blue = _mm_set1_epi32(-14942 & 0xffff);
+  const __m128i to_green = _mm_set1_epi32((18734 << 16) | (-22554 & 0xffff));
+  // Rounding bias of ToPixels(), which depends on the column parity.
+  const __m128i pixel_bias = (x & 1) ? _mm_set1_epi32(7 | (8 << 16)) :
+      _mm_set1_epi32(8 | (7 << 16));
+  for (; i + 8 <= n; i += 8) {
+    const __m128i y = _mm_srli_epi16(_mm_add_epi16(_mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(y_row + i)), pixel_bias), 4);
+    const __m128i cb = _mm_sub_epi16(_mm_srli_epi16(_mm_add_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(cb_row + i)),
+        pixel_bias), 4), center);
+    const __m128i cr = _mm_sub_epi16(_mm_srli_epi16(_mm_add_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(cr_row + i)),
+        pixel_bias), 4), center);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i cr_lo = _mm_unpacklo_epi16(cr, zero);
+    const __m128i cr_hi = _mm_unpackhi_epi16(cr, zero);
+    const __m128i cb_lo = _mm_unpacklo_epi16(cb, zero);
+    const __m128i cb_hi = _mm_unpackhi_epi16(cb, zero);
+    const __m128i cbcr_lo = _mm_unpacklo_epi16(cb, cr);
+    const __m128i cbcr_hi = _mm_unpackhi_epi16(cb, cr);
+    const __m128i red = _mm_packs_epi32(
+        _mm_srai_epi32(_mm_add_epi32(
+            _mm_madd_epi16(cr_lo, cr_to_red), round_bias), 16),
+        _mm_srai_epi32(_mm_add_epi32(
+            _mm_madd_epi16(cr_hi, cr_to_red), round_bias), 16));
+    const __m128i blue = _mm_packs_epi32(
+        _mm_srai_epi32(_mm_add_epi32(
+            _mm_madd_epi16(cb_lo, cb_to_blue), round_bias), 16),
+        _mm_srai_epi32(_mm_add_epi32(
+            _mm_madd_epi16(cb_hi, cb_to_blue), round_bias), 16));
+    const __m128i green = _mm_packs_epi32(
+        _mm_srai_epi32(_mm_add_epi32(
+            _mm_madd_epi16(cbcr_lo, to_green), round_bias), 16),
+        _mm_srai_epi32(_mm_add_epi32(
+            _mm_madd_epi16(cbcr_hi, to_green), round_bias), 16));
+    // The saturating pack does the clamping of kRangeLimit.
+    const __m128i r = _mm_add_epi16(y, _mm_add_epi16(cr, red));
+    const __m128i g = _mm_sub_epi16(_mm_add_epi16(y, green), cr);
+    const __m128i b = _mm_add_epi16(_mm_add_epi16(y, blue),
+                                    _mm_add_epi16(cb, cb));
+    const __m128i rg = _mm_packus_epi16(r, g);
+    const __m128i bb = _mm_packus_epi16(b, b);
+    // SSE2 has no byte shuffle, so the interleaving is done via memory.
+    uint8_t planes[24];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(planes), rg);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(planes + 16), bb);
+    for (int k = 0; k < 8; ++k) {
+      out[3 * k] = planes[k];
+      out[3 * k + 1] = planes[8 + k];
+      out[3 * k + 2] = planes[16 + k];
+    }
+    out += 24;
+  }
+#endif  // __SSE2__
+  for (; i < n; ++i, out += 3) {
+    const int bias = 8 - ((x + i) & 1);
+    out[0] = static_cast<uint8_t>((y_row[i] + bias) >> 4);
+    out[1] = static_cast<uint8_t>((cb_row[i] + bias) >> 4);
+    out[2] = static_cast<uint8_t>((cr_row[i] + bias) >> 4);
+    ColorTransformYCbCrToRGB(out);
+  }
+}
+
+}  // namespace
+
 std::vector<uint8_t> OutputImage::ToSRGB(int xmin, int ymin,
                                          int xsize, int ysize) const {
+  assert(xmin >= 0);
+  assert(ymin >= 0);
+  assert(xmin < width_);
+  assert(ymin < height_);
   std::vector<uint8_t> rgb(xsize * ysize * 3);
-  for (int c = 0; c < 3; ++c) {
-    components_[c].ToPixels(xmin, ymin, xsize, ysize, &rgb[c], 3);
-  }
-  for (size_t p = 0; p < rgb.size(); p += 3) {
-    ColorTransformYCbCrToRGB(&rgb[p]);
+  const int row_size = 3 * xsize;
+  // Pixels outside of the image are duplicated from the edges, the same way
+  // as in OutputImageComponent::ToPixels().
+  const int xend = std::min(xmin + xsize, width_);
+  for (int y = 0; y < ysize; ++y) {
+    uint8_t* row = &rgb[y * row_size];
+    if (ymin + y >= height_) {
+      memcpy(row, row - row_size, row_size);
+      continue;
+    }
+    YCbCrRowToRGB(components_[0].pixel_row(ymin + y) + xmin,
+                  components_[1].pixel_row(ymin + y) + xmin,
+                  components_[2].pixel_row(ymin + y) + xmin,
+                  xmin, xend - xmin, row);
+    for (int x = xend - xmin; x < xsize; ++x) {
+      memcpy(&row[3 * x], &row[3 * x - 3], 3);
+    }
   }
   return rgb;
 }
@@ -369,11 +591,11 @@ std::vector<uint8_t> OutputImage::ToSRGB() const {
 
 void OutputImage::ToLinearRGB(int xmin, int ymin, int xsize, int ysize,
                               std::vector<std::vector<float> >* rgb) const {
-  const double* lut = Srgb8ToLinearTable();
+  const float* lut = Srgb8ToLinearFloatTable();
   std::vector<uint8_t> rgb_pixels = ToSRGB(xmin, ymin, xsize, ysize);
   for (int p = 0; p < xsize * ysize; ++p) {
     for (int i = 0; i < 3; ++i) {
-      (*rgb)[i][p] = static_cast<float>(lut[rgb_pixels[3 * p + i]]);
+      (*rgb)[i][p] = lut[rgb_pixels[3 * p + i]];
     }
   }
 }
@@ -382,6 +604,21 @@ void OutputImage::ToLinearRGB(std::vector<std::vector<float> >* rgb) const {
   ToLinearRGB(0, 0, width_, height_, rgb);
 }
 
+std::vector<int> OutputImage::DirtyBlocks() const {
+  std::vector<int> blocks;
+  for (const OutputImageComponent& comp : components_) {
+    blocks.insert(blocks.end(), comp.dirty_blocks().begin(),
+                  comp.dirty_blocks().end());
+  }
+  return blocks;
+}
+
+void OutputImage::ClearDirtyBlocks() {
+  for (OutputImageComponent& comp : components_) {
+    comp.ClearDirtyBlocks();
+  }
+}
+
 std::string OutputImage::FrameTypeStr() const {
   char buf[128];
   int len = snprintf(buf, sizeof(buf), "f%d%d%d%d%d%d",
@@ -24,6 +24,8 @@
 
 namespace guetzli {
 
+class ThreadPool;
+
 class OutputImageComponent {
  public:
   OutputImageComponent(int w, int h);
@@ -38,6 +40,8 @@ class OutputImageComponent {
   int height_in_blocks() const { return height_in_blocks_; }
   const coeff_t* coeffs() const { return &coeffs_[0]; }
   const int* quant() const { return &quant_[0]; }
+  // Returns row y of the pixel values, upscaled by 16 (see ToPixels()).
+  const uint16_t* pixel_row(int y) const { return &pixels_[y * width_]; }
   bool IsAllZero() const;
 
   // Fills in block[] with the 8x8 coefficient block with block coordinates
@@ -68,13 +72,31 @@ class OutputImageComponent {
                      const coeff_t block[kDCTBlockSize]);
 
   // Requires that comp is not downsampled.
+  // The pixels of 2x2 subsampled components are computed with a single
+  // upsampling pass over the whole component, which gives the same result as
+  // calling SetCoeffBlock() for each block.
   void CopyFromJpegComponent(const JPEGComponent& comp,
                              int factor_x, int factor_y,
                              const int* quant);
 
+  // Rounds each coefficient to the nearest multiple of the corresponding
+  // value of q[], and makes q[] the quant table of the component.
+  void ApplyGlobalQuantization(const int q[kDCTBlockSize]);
+
+  // Returns the indexes of the 8x8 pixel areas of the image, in row-major
+  // order of the (width + 7) / 8 by (height + 7) / 8 grid, in which some
+  // pixels have changed since the last call to ClearDirtyBlocks(). Every
+  // index appears at most once.
+  const std::vector<int>& dirty_blocks() const { return dirty_list_; }
+
+  void ClearDirtyBlocks();
+
  private:
   void UpdatePixelsForBlock(int block_x, int block_y,
                             const uint8_t idct[kDCTBlockSize]);
+  // Marks the 8x8 pixel areas that intersect the pixel rectangle with the
+  // given inclusive corners as dirty.
+  void MarkDirty(int xmin, int ymin, int xmax, int ymax);
 
   const int width_;
   const int height_;
@@ -87,6 +109,22 @@ class OutputImageComponent {
   std::vector<uint16_t> pixels_;
   // default is all 1s.
   int quant_[kDCTBlockSize];
+  std::vector<uint8_t> dirty_;
+  std::vector<int> dirty_list_;
+};
+
+struct DownsampleConfig {
+  // The default is YUV420.
+  int u_factor_x = 2;
+  int u_factor_y = 2;
+  int v_factor_x = 2;
+  int v_factor_y = 2;
+  bool u_sharpen = true;
+  bool u_blur = true;
+  bool v_sharpen = true;
+  bool v_blur = true;
+  // Use gamma-compensated averaging of the sRGB pixels for YUV420.
+  bool use_silver_screen = false;
 };
 
 class OutputImage {
@@ -102,6 +140,13 @@ class OutputImage {
   // Requires that jpg is in YUV444 format.
   void CopyFromJpegData(const JPEGData& jpg);
 
+  // Downsamples the chroma components of a YUV444 image. The coefficients of
+  // the downsampled components are not quantized (see
+  // ApplyGlobalQuantization()). pool may be null.
+  void Downsample(const DownsampleConfig& cfg, ThreadPool* pool);
+
+  void ApplyGlobalQuantization(const int q[3][kDCTBlockSize]);
+
   void SaveToJpegData(JPEGData* jpg) const;
 
   std::vector<uint8_t> ToSRGB() const;
@@ -115,6 +160,14 @@ class OutputImage {
 
   std::string FrameTypeStr() const;
 
+  // Returns the indexes of the 8x8 pixel areas (see
+  // OutputImageComponent::dirty_blocks()) that have changed in any of the
+  // components since the last call to ClearDirtyBlocks(). The same index may
+  // appear several times.
+  std::vector<int> DirtyBlocks() const;
+
+  void ClearDirtyBlocks();
+
  private:
   const int width_;
   const int height_;
@@ -18,9 +18,17 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <stdint.h>
 #include <string.h>
 #include <cmath>
 
+#ifdef __SSE2__
+#include <xmmintrin.h>
+#endif  // __SSE2__
+
+#include "guetzli/gamma_correct.h"
+#include "guetzli/thread_pool.h"
+
 using std::size_t;
 
 namespace {
@@ -49,35 +57,102 @@ std::vector<float> Convolve2D(const std::vector<float>& image, int w, int h,
   return result;
 }
 
-// convolve horizontally and vertically with 1D kernel
-std::vector<float> Convolve2X(const std::vector<float>& image, int w, int h,
-                              const double* kernel, int size, double mul) {
-  auto temp = image;
-  int size2 = size / 2;
-  for (size_t i = 0; i < image.size(); i++) {
-    int x = i % w;
-    int y = i / w;
-    // Avoid non-normalized results at boundary by skipping edges.
-    if (x < size2 || x + size - size2 - 1 >= w) continue;
+// Number of output rows computed from one band of the horizontal pass of
+// Convolve2X(). The band is small enough to stay in cache for the vertical
+// pass.
+static const int kConvolveBandRows = 32;
+
+// Convolves one row of w pixels horizontally with the 1D kernel and scales
+// the result by mul. Pixels for which the kernel would extend past the row are
+// copied unchanged.
+void ConvolveRow(const float* in, int w, const float* kernel, int size,
+                 float mul, float* out) {
+  const int size2 = size / 2;
+  const int xend = w - (size - size2 - 1);
+  if (xend <= size2) {
+    memcpy(out, in, w * sizeof(out[0]));
+    return;
+  }
+  memcpy(out, in, size2 * sizeof(out[0]));
+  memcpy(out + xend, in + xend, (w - xend) * sizeof(out[0]));
+  int x = size2;
+#ifdef __SSE2__
+  const __m128 vmul = _mm_set1_ps(mul);
+  for (; x + 4 <= xend; x += 4) {
+    const float* p = in + x - size2;
+    __m128 v = _mm_setzero_ps();
+    for (int j = 0; j < size; j++) {
+      v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(kernel[j]),
+                                   _mm_loadu_ps(p + j)));
+    }
+    _mm_storeu_ps(out + x, _mm_mul_ps(v, vmul));
+  }
+#endif  // __SSE2__
+  for (; x < xend; x++) {
+    const float* p = in + x - size2;
     float v = 0;
     for (int j = 0; j < size; j++) {
-      int x2 = x + j - size2;
-      v += static_cast<float>(kernel[j]) * image[y * w + x2];
+      v += kernel[j] * p[j];
     }
-    temp[i] = v * static_cast<float>(mul);
+    out[x] = v * mul;
   }
-  auto result = temp;
-  for (size_t i = 0; i < temp.size(); i++) {
-    int x = i % w;
-    int y = i / w;
-    // Avoid non-normalized results at boundary by skipping edges.
-    if (y < size2 || y + size - size2 - 1 >= h) continue;
+}
+
+// Convolves the size rows starting at in vertically with the 1D kernel and
+// stores the scaled result for the middle row in out.
+void ConvolveColumns(const float* in, int stride, int w, const float* kernel,
+                     int size, float mul, float* out) {
+  int x = 0;
+#ifdef __SSE2__
+  const __m128 vmul = _mm_set1_ps(mul);
+  for (; x + 4 <= w; x += 4) {
+    const float* p = in + x;
+    __m128 v = _mm_setzero_ps();
+    for (int j = 0; j < size; j++) {
+      v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(kernel[j]),
+                                   _mm_loadu_ps(p + j * stride)));
+    }
+    _mm_storeu_ps(out + x, _mm_mul_ps(v, vmul));
+  }
+#endif  // __SSE2__
+  for (; x < w; x++) {
+    const float* p = in + x;
     float v = 0;
     for (int j = 0; j < size; j++) {
-      int y2 = y + j - size2;
-      v += static_cast<float>(kernel[j]) * temp[y2 * w + x];
+      v += kernel[j] * p[j * stride];
+    }
+    out[x] = v * mul;
+  }
+}
+
+// convolve horizontally and vertically with 1D kernel
+// The image is processed in bands of rows, with the horizontal pass of each
+// band (and its size / 2 halo rows) kept in a small buffer.
+std::vector<float> Convolve2X(const std::vector<float>& image, int w, int h,
+                              const double* kernel, int size, double mul) {
+  std::vector<float> kernelf(kernel, kernel + size);
+  const float mulf = static_cast<float>(mul);
+  const int size2 = size / 2;
+  const int below = size - size2 - 1;
+  std::vector<float> result(image.size());
+  std::vector<float> temp((kConvolveBandRows + size - 1) * w);
+  for (int y0 = 0; y0 < h; y0 += kConvolveBandRows) {
+    const int y1 = std::min(h, y0 + kConvolveBandRows);
+    const int t0 = std::max(0, y0 - size2);
+    const int t1 = std::min(h, y1 + below);
+    for (int y = t0; y < t1; y++) {
+      ConvolveRow(&image[y * w], w, kernelf.data(), size, mulf,
+                  &temp[(y - t0) * w]);
+    }
+    for (int y = y0; y < y1; y++) {
+      // Avoid non-normalized results at boundary by skipping edges.
+      if (y < size2 || y + below >= h) {
+        memcpy(&result[y * w], &temp[(y - t0) * w], w * sizeof(result[0]));
+        continue;
+      }
+      ConvolveColumns(&temp[(y - size2 - t0) * w], w, w, kernelf.data(), size,
+                      mulf, &result[y * w]);
     }
-    result[i] = v * static_cast<float>(mul);
   }
   return result;
 }
@@ -107,27 +182,86 @@ std::vector<float> Sharpen(const std::vector<float>& image, int w, int h,
   return result;
 }
 
-void Erode(int w, int h, std::vector<bool>* image) {
-  std::vector<bool> temp = *image;
-  for (int y = 1; y + 1 < h; y++) {
-    for (int x = 1; x + 1 < w; x++) {
-      size_t index = y * w + x;
-      if (!(temp[index] && temp[index - 1] && temp[index + 1]
-          && temp[index - w] && temp[index + w])) {
-        (*image)[index] = 0;
-      }
+// Binary image with one bit per pixel, packed into 64-bit words, so that the
+// morphological operations can work on 64 pixels at a time.
+class BitMask {
+ public:
+  BitMask(int w, int h)
+      : width_(w), height_(h), stride_((w + 63) / 64), words_(stride_ * h) {}
+
+  bool Get(int x, int y) const {
+    return (words_[y * stride_ + (x >> 6)] >> (x & 63)) & 1;
+  }
+  void Set(int x, int y) {
+    words_[y * stride_ + (x >> 6)] |= static_cast<uint64_t>(1) << (x & 63);
+  }
+
+  // Clears the bits that are not set in other.
+  void Intersect(const BitMask& other) {
+    for (size_t i = 0; i < words_.size(); i++) {
+      words_[i] &= other.words_[i];
     }
   }
+
+  // Applies the given number of erosions (dilations) with the 4-neighbourhood.
+  // The edge pixels of the image are never changed.
+  void Erode(int iterations) { Morph(iterations, true); }
+  void Dilate(int iterations) { Morph(iterations, false); }
+
+ private:
+  void Morph(int iterations, bool erode);
+
+  const int width_;
+  const int height_;
+  const int stride_;
+  std::vector<uint64_t> words_;
+};
+
+// Computes one row of an erosion (dilation) from the row and its neighbours.
+// Only the bits set in interior are updated, the others are copied.
+void MorphRow(const uint64_t* above, const uint64_t* row,
+              const uint64_t* below, const uint64_t* interior, int stride,
+              bool erode, uint64_t* out) {
+  for (int i = 0; i < stride; i++) {
+    const uint64_t c = row[i];
+    const uint64_t prev = i > 0 ? row[i - 1] : 0;
+    const uint64_t next = i + 1 < stride ? row[i + 1] : 0;
+    const uint64_t left = (c << 1) | (prev >> 63);
+    const uint64_t right = (c >> 1) | (next << 63);
+    const uint64_t v = erode ? (c & left & right & above[i] & below[i]) :
+        (c | left | right | above[i] | below[i]);
+    out[i] = (v & interior[i]) | (c & ~interior[i]);
+  }
 }
 
-void Dilate(int w, int h, std::vector<bool>* image) {
-  std::vector<bool> temp = *image;
-  for (int y = 1; y + 1 < h; y++) {
-    for (int x = 1; x + 1 < w; x++) {
-      size_t index = y * w + x;
-      if (temp[index] || temp[index - 1] || temp[index + 1]
-          || temp[index - w] || temp[index + w]) {
-        (*image)[index] = 1;
+// All iterations are done in a single sweep over the rows: iteration s
+// produces row y - s as soon as iteration s - 1 has produced row y - s + 1.
+// Each iteration keeps its last three rows in a small ring buffer, which gives
+// the same result as running the iterations one after the other.
+void BitMask::Morph(int iterations, bool erode) {
+  if (iterations <= 0 || width_ < 3 || height_ < 3) return;
+  std::vector<uint64_t> interior(stride_);
+  for (int x = 1; x + 1 < width_; x++) {
+    interior[x >> 6] |= static_cast<uint64_t>(1) << (x & 63);
+  }
+  const size_t row_bytes = stride_ * sizeof(words_[0]);
+  std::vector<uint64_t> rings(iterations * 3 * stride_);
+  for (int t = 0; t < height_ + iterations; t++) {
+    if (t < height_) {
+      memcpy(&rings[(t % 3) * stride_], &words_[t * stride_], row_bytes);
+    }
+    for (int s = 1; s <= iterations; s++) {
+      const int y = t - s;
+      if (y < 0 || y >= height_) continue;
+      const uint64_t* in = &rings[(s - 1) * 3 * stride_];
+      uint64_t* out = s == iterations ? &words_[y * stride_] :
+          &rings[(s * 3 + y % 3) * stride_];
+      if (y == 0 || y + 1 == height_) {
+        memcpy(out, &in[(y % 3) * stride_], row_bytes);
+      } else {
+        MorphRow(&in[((y - 1) % 3) * stride_], &in[(y % 3) * stride_],
+                 &in[((y + 1) % 3) * stride_], interior.data(), stride_, erode,
+                 out);
       }
     }
   }
@@ -148,55 +282,58 @@ std::vector<float> Blur(const std::vector<float>& image, int w, int h) {
     return Convolve2X(image, w, h, kernel.data(), kernel.size(), mul);
 }
 
-}  // namespace
-
-namespace guetzli {
+// Size of the tiles that PreProcessChannel() works on.
+static const int kPreProcessTileSize = 128;
+// Distance up to which the pixels around a tile affect the result inside it:
+// three erosions (dilations) of the dark (red) map, the 3x3 edge filter and two
+// more erosions of the blur map. The 5x5 sharpen and blur filters need less.
+static const int kPreProcessTileBorder = 5;
+
+// Brings a pixel of YUV channel c in range 0.0-1.0 for Y, -0.5 - 0.5 for U and
+// V, and back.
+inline float ToUnitRange(int c, float v) {
+  return c == 0 ? static_cast<float>(v / 255.0) : v / 255.0f - 0.5f;
+}
 
-// Do the sharpening to the v channel, but only in areas where it will help
-// channel should be 2 for v sharpening, or 1 for less effective u sharpening
-std::vector<std::vector<float>> PreProcessChannel(
-    int w, int h, int channel, float sigma, float amount, bool blur,
-    bool sharpen, const std::vector<std::vector<float>>& image) {
-  if (!blur && !sharpen) return image;
+inline float FromUnitRange(int c, float v) {
+  return c == 0 ? static_cast<float>(v * 255.0) : (v + 0.5f) * 255.0f;
+}
 
-  // Bring in range 0.0-1.0 for Y, -0.5 - 0.5 for U and V
-  auto yuv = image;
-  for (size_t i = 0; i < yuv[0].size(); i++) {
-    yuv[0][i] /= 255.0;
-    yuv[1][i] = yuv[1][i] / 255.0f - 0.5f;
-    yuv[2][i] = yuv[2][i] / 255.0f - 0.5f;
-  }
+// Does the sharpening and blurring of PreProcessChannel() on the w x h image
+// yuv, which has already been brought in range with ToUnitRange().
+void PreProcessUnitRangeChannel(int w, int h, int channel, float sigma,
+                                float amount, bool blur, bool sharpen,
+                                std::vector<std::vector<float>>* yuv_ptr) {
+  std::vector<std::vector<float>>& yuv = *yuv_ptr;
 
   // Map of areas where the image is not too bright to apply the effect.
-  std::vector<bool> darkmap(image[0].size(), false);
+  BitMask darkmap(w, h);
   for (int y = 0; y < h; y++) {
     for (int x = 0; x < w; x++) {
       size_t index = y * w + x;
-      float y = yuv[0][index];
+      float luma = yuv[0][index];
       float u = yuv[1][index];
       float v = yuv[2][index];
 
-      float r = y + 1.402f * v;
-      float g = y - 0.34414f * u - 0.71414f * v;
-      float b = y + 1.772f * u;
+      float r = luma + 1.402f * v;
+      float g = luma - 0.34414f * u - 0.71414f * v;
+      float b = luma + 1.772f * u;
 
       // Parameters tuned to avoid sharpening in too bright areas, where the
       // effect makes it worse instead of better.
       if (channel == 2 && g < 0.85 && b < 0.85 && r < 0.9) {
-        darkmap[index] = true;
+        darkmap.Set(x, y);
       }
       if (channel == 1 && r < 0.85 && g < 0.85 && b < 0.9) {
-        darkmap[index] = true;
+        darkmap.Set(x, y);
       }
     }
   }
 
-  Erode(w, h, &darkmap);
-  Erode(w, h, &darkmap);
-  Erode(w, h, &darkmap);
+  darkmap.Erode(3);
 
   // Map of areas where the image is red enough (blue in case of u channel).
-  std::vector<bool> redmap(image[0].size(), false);
+  BitMask redmap(w, h);
   for (int y = 0; y < h; y++) {
     for (int x = 0; x < w; x++) {
       size_t index = y * w + x;
@@ -206,26 +343,19 @@ std::vector<std::vector<float>> PreProcessChannel(
       // Parameters tuned to allow only colors on which sharpening is useful.
       if (channel == 2 && 2.116 * v > -0.34414 * u + 0.2
           && 1.402 * v > 1.772 * u + 0.2) {
-        redmap[index] = true;
+        redmap.Set(x, y);
       }
       if (channel == 1 && v < 1.263 * u - 0.1 && u > -0.33741 * v) {
-        redmap[index] = true;
+        redmap.Set(x, y);
       }
     }
   }
 
-  Dilate(w, h, &redmap);
-  Dilate(w, h, &redmap);
-  Dilate(w, h, &redmap);
+  redmap.Dilate(3);
 
   // Map of areas where to allow sharpening by combining red and dark areas
-  std::vector<bool> sharpenmap(image[0].size(), 0);
-  for (int y = 0; y < h; y++) {
-    for (int x = 0; x < w; x++) {
-      size_t index = y * w + x;
-      sharpenmap[index] = redmap[index] && darkmap[index];
-    }
-  }
+  BitMask sharpenmap = redmap;
+  sharpenmap.Intersect(darkmap);
 
   // Threshold for where considered an edge.
   const double threshold = (channel == 2 ? 0.02 : 1.0) * 127.5;
@@ -237,22 +367,21 @@ std::vector<std::vector<float>> PreProcessChannel(
   };
 
   // Map of areas where to allow blurring, only where it is not too sharp
-  std::vector<bool> blurmap(image[0].size(), false);
+  BitMask blurmap(w, h);
   std::vector<float> edge = Convolve2D(yuv[channel], w, h, kEdgeMatrix, 3);
   for (int y = 0; y < h; y++) {
     for (int x = 0; x < w; x++) {
       size_t index = y * w + x;
       float u = yuv[1][index];
       float v = yuv[2][index];
-      if (sharpenmap[index]) continue;
-      if (!darkmap[index]) continue;
+      if (sharpenmap.Get(x, y)) continue;
+      if (!darkmap.Get(x, y)) continue;
       if (fabs(edge[index]) < threshold && v < -0.162 * u) {
-        blurmap[index] = true;
+        blurmap.Set(x, y);
       }
     }
   }
-  Erode(w, h, &blurmap);
-  Erode(w, h, &blurmap);
+  blurmap.Erode(2);
 
   // Choose sharpened, blurred or original per pixel
   std::vector<float> sharpened = Sharpen(yuv[channel], w, h, sigma, amount);
@@ -261,23 +390,78 @@ std::vector<std::vector<float>> PreProcessChannel(
     for (int x = 0; x < w; x++) {
       size_t index = y * w + x;
 
-      if (sharpenmap[index]) {
+      if (sharpenmap.Get(x, y)) {
         if (sharpen) yuv[channel][index] = sharpened[index];
-      } else if (blurmap[index]) {
+      } else if (blurmap.Get(x, y)) {
         if (blur) yuv[channel][index] = blurred[index];
       }
     }
   }
+}
 
-  // Bring back to range 0-255
-  for (size_t i = 0; i < yuv[0].size(); i++) {
-    yuv[0][i] *= 255.0;
-    yuv[1][i] = (yuv[1][i] + 0.5f) * 255.0f;
-    yuv[2][i] = (yuv[2][i] + 0.5f) * 255.0f;
+}  // namespace
+
+namespace guetzli {
+
+// Do the sharpening to the v channel, but only in areas where it will help
+// channel should be 2 for v sharpening, or 1 for less effective u sharpening
+// The image is processed in tiles. Each tile is cropped with a border of
+// kPreProcessTileBorder pixels, which makes the result inside the tile the
+// same as if the whole image was processed at once.
+std::vector<std::vector<float>> PreProcessChannel(
+    int w, int h, int channel, float sigma, float amount, bool blur,
+    bool sharpen, const std::vector<std::vector<float>>& image,
+    ThreadPool* pool) {
+  if (!blur && !sharpen) return image;
+
+  std::vector<std::vector<float>> yuv(3, std::vector<float>(image[0].size()));
+  for (int c = 0; c < 3; c++) {
+    if (c == channel) continue;
+    for (size_t i = 0; i < yuv[c].size(); i++) {
+      yuv[c][i] = FromUnitRange(c, ToUnitRange(c, image[c][i]));
+    }
   }
+
+  const int tiles_x = (w + kPreProcessTileSize - 1) / kPreProcessTileSize;
+  const int tiles_y = (h + kPreProcessTileSize - 1) / kPreProcessTileSize;
+  ParallelFor(pool, tiles_x * tiles_y, [&](int tile) {
+    const int x0 = (tile % tiles_x) * kPreProcessTileSize;
+    const int y0 = (tile / tiles_x) * kPreProcessTileSize;
+    const int x1 = std::min(w, x0 + kPreProcessTileSize);
+    const int y1 = std::min(h, y0 + kPreProcessTileSize);
+    const int crop_x0 = std::max(0, x0 - kPreProcessTileBorder);
+    const int crop_y0 = std::max(0, y0 - kPreProcessTileBorder);
+    const int crop_w = std::min(w, x1 + kPreProcessTileBorder) - crop_x0;
+    const int crop_h = std::min(h, y1 + kPreProcessTileBorder) - crop_y0;
+    std::vector<std::vector<float>> crop(3,
+                                         std::vector<float>(crop_w * crop_h));
+    for (int c = 0; c < 3; c++) {
+      for (int y = 0; y < crop_h; y++) {
+        const float* row = &image[c][(crop_y0 + y) * w + crop_x0];
+        for (int x = 0; x < crop_w; x++) {
+          crop[c][y * crop_w + x] = ToUnitRange(c, row[x]);
+        }
+      }
+    }
+    PreProcessUnitRangeChannel(crop_w, crop_h, channel, sigma, amount, blur,
+                               sharpen, &crop);
+    for (int y = y0; y < y1; y++) {
+      const float* row = &crop[channel][(y - crop_y0) * crop_w];
+      for (int x = x0; x < x1; x++) {
+        yuv[channel][y * w + x] = FromUnitRange(channel, row[x - crop_x0]);
+      }
+    }
+  });
   return yuv;
 }
 
+std::vector<std::vector<float>> PreProcessChannel(
+    int w, int h, int channel, float sigma, float amount, bool blur,
+    bool sharpen, const std::vector<std::vector<float>>& image) {
+  return PreProcessChannel(w, h, channel, sigma, amount, blur, sharpen, image,
+                           nullptr);
+}
+
 namespace {
 
 inline float Clip(float val) {
@@ -308,171 +492,194 @@ inline float YUVToB(float y, float u, float v) {
   return y + 1.772f * (u - 128.0f);
 }
 
-// TODO(user) Use SRGB->linear conversion and a lookup-table.
-inline float GammaToLinear(float x) {
-  return static_cast<float>(std::pow(x / 255.0f, 2.2));
-}
-
-// TODO(user) Use linear->SRGB conversion and a lookup-table.
-inline float LinearToGamma(float x) {
-  return 255.0 * std::pow(x, 1.0 / 2.2);
+// Number of subsampled rows that RGBToYUV420() processes in one task.
+static const int kYUV420BandRows = 8;
+
+// Computes the linear RGB values of row y of the image that a decoder would
+// produce from the given YUV image with 2x2 subsampled U and V planes, using
+// the "fancy upsample" filter of libjpeg for U and V.
+void YUV420RowToLinearRGB(const std::vector<float>& y_plane,
+                          const std::vector<float>& u_plane,
+                          const std::vector<float>& v_plane,
+                          const int width, const int height, const int y,
+                          float* out) {
+  const int w = (width + 1) / 2;
+  const int h = (height + 1) / 2;
+  const int sy = y / 2;
+  const int sy1 = std::min(h - 1, std::max(0, sy + 2 * (y & 1) - 1));
+  const float* u0 = &u_plane[sy * w];
+  const float* u1 = &u_plane[sy1 * w];
+  const float* v0 = &v_plane[sy * w];
+  const float* v1 = &v_plane[sy1 * w];
+  const float* yrow = &y_plane[y * width];
+  float* rgb = out;
+  for (int x = 0; x < width; ++x, rgb += 3) {
+    const int sx = x / 2;
+    const int sx1 = std::min(w - 1, std::max(0, sx + 2 * (x & 1) - 1));
+    const float u = (9.0f * u0[sx] + 3.0f * u0[sx1] + 3.0f * u1[sx] +
+                     1.0f * u1[sx1]) / 16.0f;
+    const float v = (9.0f * v0[sx] + 3.0f * v0[sx1] + 3.0f * v1[sx] +
+                     1.0f * v1[sx1]) / 16.0f;
+    rgb[0] = Clip(YUVToR(yrow[x], u, v));
+    rgb[1] = Clip(YUVToG(yrow[x], u, v));
+    rgb[2] = Clip(YUVToB(yrow[x], u, v));
+  }
+  GammaToLinearRow(out, 3 * width, out);
 }
 
-std::vector<float> LinearlyAveragedLuma(const std::vector<float>& rgb) {
-  assert(rgb.size() % 3 == 0);
-  std::vector<float> y(rgb.size() / 3);
-  for (size_t i = 0, p = 0; p < rgb.size(); ++i, p += 3) {
-    y[i] = LinearToGamma(RGBToY(GammaToLinear(rgb[p + 0]),
-                                GammaToLinear(rgb[p + 1]),
-                                GammaToLinear(rgb[p + 2])));
+void RGBRowToLinearRGB(const uint8_t* rgb, const int width, float* out) {
+  const float* lut = Gamma8ToLinearTable();
+  for (int i = 0; i < 3 * width; ++i) {
+    out[i] = lut[rgb[i]];
   }
-  return y;
 }
 
-std::vector<float> LinearlyDownsample2x2(const std::vector<float>& rgb_in,
-                                         const int width, const int height) {
-  assert(rgb_in.size() == 3 * width * height);
-  int w = (width + 1) / 2;
-  int h = (height + 1) / 2;
-  std::vector<float> rgb_out(3 * w * h);
-  for (int y = 0, p = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x) {
-      for (int i = 0; i < 3; ++i, ++p) {
-        rgb_out[p] = 0.0;
-        for (int iy = 0; iy < 2; ++iy) {
-          for (int ix = 0; ix < 2; ++ix) {
-            int yy = std::min(height - 1, 2 * y + iy);
-            int xx = std::min(width - 1, 2 * x + ix);
-            rgb_out[p] += GammaToLinear(rgb_in[3 * (yy * width + xx) + i]);
-          }
-        }
-        rgb_out[p] = LinearToGamma(0.25f * rgb_out[p]);
-      }
+// Computes the gamma-compensated luma of two consecutive image rows, and the
+// Y, U and V values of their linearly averaged 2x2 blocks, from the linear RGB
+// values of the rows. If the image has an odd height, lin1 is the same as
+// lin0 for the last row, and luma1 is null. sub_y can also be null. scratch
+// must have room for 3 * ((width + 1) / 2) values.
+void LinearRGBToYUV420Row(const float* lin0, const float* lin1,
+                          const int width, float* luma0, float* luma1,
+                          float* sub_y, float* sub_u, float* sub_v,
+                          float* scratch) {
+  for (int x = 0; x < width; ++x) {
+    luma0[x] = RGBToY(lin0[3 * x], lin0[3 * x + 1], lin0[3 * x + 2]);
+  }
+  LinearToGammaRow(luma0, width, luma0);
+  if (luma1 != nullptr) {
+    for (int x = 0; x < width; ++x) {
+      luma1[x] = RGBToY(lin1[3 * x], lin1[3 * x + 1], lin1[3 * x + 2]);
     }
+    LinearToGammaRow(luma1, width, luma1);
   }
-  return rgb_out;
-}
-
-std::vector<std::vector<float> > RGBToYUV(const std::vector<float>& rgb) {
-  std::vector<std::vector<float> > yuv(3, std::vector<float>(rgb.size() / 3));
-  for (size_t i = 0, p = 0; p < rgb.size(); ++i, p += 3) {
-    const float r = rgb[p + 0];
-    const float g = rgb[p + 1];
-    const float b = rgb[p + 2];
-    yuv[0][i] = RGBToY(r, g, b);
-    yuv[1][i] = RGBToU(r, g, b);
-    yuv[2][i] = RGBToV(r, g, b);
+  const int w = (width + 1) / 2;
+  for (int x = 0; x < w; ++x) {
+    const int x0 = 3 * (2 * x);
+    const int x1 = 3 * std::min(width - 1, 2 * x + 1);
+    for (int i = 0; i < 3; ++i) {
+      scratch[3 * x + i] =
+          0.25f * (lin0[x0 + i] + lin0[x1 + i] + lin1[x0 + i] + lin1[x1 + i]);
+    }
+  }
+  LinearToGammaRow(scratch, 3 * w, scratch);
+  for (int x = 0; x < w; ++x) {
+    const float* rgb = &scratch[3 * x];
+    if (sub_y != nullptr) sub_y[x] = RGBToY(rgb[0], rgb[1], rgb[2]);
+    sub_u[x] = RGBToU(rgb[0], rgb[1], rgb[2]);
+    sub_v[x] = RGBToV(rgb[0], rgb[1], rgb[2]);
   }
-  return yuv;
 }
 
-std::vector<float> YUVToRGB(const std::vector<std::vector<float> >& yuv) {
-  std::vector<float> rgb(3 * yuv[0].size());
-  for (size_t i = 0, p = 0; p < rgb.size(); ++i, p += 3) {
-    const float y = yuv[0][i];
-    const float u = yuv[1][i];
-    const float v = yuv[2][i];
-    rgb[p + 0] = Clip(YUVToR(y, u, v));
-    rgb[p + 1] = Clip(YUVToG(y, u, v));
-    rgb[p + 2] = Clip(YUVToB(y, u, v));
+void UpdateGuess(const float* target, const float* reconstructed, int n,
+                 float* guess) {
+  for (int i = 0; i < n; ++i) {
+    // TODO(user): Evaluate using a decaying constant here.
+    guess[i] = Clip(guess[i] - (reconstructed[i] - target[i]));
   }
-  return rgb;
 }
 
-// Upsamples img_in with a box-filter, and returns an image with output
-// dimensions width x height.
+// Upsamples img_in with a box-filter to an image with dimensions
+// width x height.
 std::vector<float> Upsample2x2(const std::vector<float>& img_in,
                                const int width, const int height) {
-  int w = (width + 1) / 2;
-  int h = (height + 1) / 2;
-  assert(img_in.size() == w * h);
+  const int w = (width + 1) / 2;
+  assert(img_in.size() == static_cast<size_t>(w) * ((height + 1) / 2));
   std::vector<float> img_out(width * height);
-  for (int y = 0, p = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x, ++p) {
-      for (int iy = 0; iy < 2; ++iy) {
-        for (int ix = 0; ix < 2; ++ix) {
-          int yy = std::min(height - 1, 2 * y + iy);
-          int xx = std::min(width - 1, 2 * x + ix);
-          img_out[yy * width + xx] = img_in[p];
-        }
-      }
+  for (int y = 0, p = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x, ++p) {
+      img_out[p] = img_in[(y / 2) * w + x / 2];
     }
   }
   return img_out;
 }
 
-// Apply the "fancy upsample" filter used by libjpeg.
-std::vector<float> Blur(const std::vector<float>& img,
-                        const int width, const int height) {
-  std::vector<float> img_out(width * height);
-  for (int y0 = 0; y0 < height; y0 += 2) {
-    for (int x0 = 0; x0 < width; x0 += 2) {
-      for (int iy = 0; iy < 2 && y0 + iy < height; ++iy) {
-        for (int ix = 0; ix < 2 && x0 + ix < width; ++ix) {
-          int dy = 4 * iy - 2;
-          int dx = 4 * ix - 2;
-          int x1 = std::min(width - 1, std::max(0, x0 + dx));
-          int y1 = std::min(height - 1, std::max(0, y0 + dy));
-          img_out[(y0 + iy) * width + x0 + ix] =
-              (9.0f * img[y0 * width + x0] +
-               3.0f * img[y0 * width + x1] +
-               3.0f * img[y1 * width + x0] +
-               1.0f * img[y1 * width + x1]) / 16.0f;
-        }
+}  // namespace
+
+// Each iteration first reconstructs the image from the current guess in
+// bands of rows, and only then updates the guess, so the bands can be done in
+// parallel with the same result as a serial run. All planes are allocated
+// once, before the iterations.
+std::vector<std::vector<float> > RGBToYUV420(
+    const std::vector<uint8_t>& rgb_in, const int width, const int height,
+    ThreadPool* pool) {
+  const int w = (width + 1) / 2;
+  const int h = (height + 1) / 2;
+  const int num_bands = (h + kYUV420BandRows - 1) / kYUV420BandRows;
+  std::vector<float> y_target(width * height);
+  std::vector<float> u_target(w * h);
+  std::vector<float> v_target(w * h);
+  std::vector<float> y_subsampled(w * h);
+  // Linear RGB values of two image rows and the scratch space of
+  // LinearRGBToYUV420Row() for each band.
+  std::vector<std::vector<float> > band_rows(
+      num_bands, std::vector<float>(6 * width + 3 * w));
+  ParallelFor(pool, num_bands, [&](int band) {
+    float* lin0 = &band_rows[band][0];
+    float* lin1 = &band_rows[band][3 * width];
+    const int y_end = std::min(h, (band + 1) * kYUV420BandRows);
+    for (int y = band * kYUV420BandRows; y < y_end; ++y) {
+      const bool has_row1 = 2 * y + 1 < height;
+      RGBRowToLinearRGB(&rgb_in[3 * 2 * y * width], width, lin0);
+      if (has_row1) {
+        RGBRowToLinearRGB(&rgb_in[3 * (2 * y + 1) * width], width, lin1);
       }
+      LinearRGBToYUV420Row(lin0, has_row1 ? lin1 : lin0, width,
+                           &y_target[2 * y * width],
+                           has_row1 ? &y_target[(2 * y + 1) * width] : nullptr,
+                           &y_subsampled[y * w], &u_target[y * w],
+                           &v_target[y * w], &band_rows[band][6 * width]);
     }
+  });
+  std::vector<float> y_guess = Upsample2x2(y_subsampled, width, height);
+  std::vector<float> u_guess = u_target;
+  std::vector<float> v_guess = v_target;
+  std::vector<float> y_rec(width * height);
+  std::vector<float> u_rec(w * h);
+  std::vector<float> v_rec(w * h);
+  // TODO(user): Stop early if the error is small enough.
+  for (int iter = 0; iter < 20; ++iter) {
+    ParallelFor(pool, num_bands, [&](int band) {
+      float* lin0 = &band_rows[band][0];
+      float* lin1 = &band_rows[band][3 * width];
+      const int y_end = std::min(h, (band + 1) * kYUV420BandRows);
+      for (int y = band * kYUV420BandRows; y < y_end; ++y) {
+        const bool has_row1 = 2 * y + 1 < height;
+        YUV420RowToLinearRGB(y_guess, u_guess, v_guess, width, height, 2 * y,
+                             lin0);
+        if (has_row1) {
+          YUV420RowToLinearRGB(y_guess, u_guess, v_guess, width, height,
+                               2 * y + 1, lin1);
+        }
+        LinearRGBToYUV420Row(lin0, has_row1 ? lin1 : lin0, width,
+                             &y_rec[2 * y * width],
+                             has_row1 ? &y_rec[(2 * y + 1) * width] : nullptr,
+                             nullptr, &u_rec[y * w], &v_rec[y * w],
+                             &band_rows[band][6 * width]);
+      }
+    });
+    ParallelFor(pool, num_bands, [&](int band) {
+      const int y0 = band * kYUV420BandRows;
+      const int y1 = std::min(h, y0 + kYUV420BandRows);
+      const int rows = std::min(height, 2 * y1) - 2 * y0;
+      UpdateGuess(&y_target[2 * y0 * width], &y_rec[2 * y0 * width],
+                  rows * width, &y_guess[2 * y0 * width]);
+      UpdateGuess(&u_target[y0 * w], &u_rec[y0 * w], (y1 - y0) * w,
+                  &u_guess[y0 * w]);
+      UpdateGuess(&v_target[y0 * w], &v_rec[y0 * w], (y1 - y0) * w,
+                  &v_guess[y0 * w]);
+    });
   }
-  return img_out;
-}
-
-std::vector<float> YUV420ToRGB(const std::vector<std::vector<float> >& yuv420,
-                               const int width, const int height) {
-  std::vector<std::vector<float> > yuv;
-  yuv.push_back(yuv420[0]);
-  std::vector<float> u = Upsample2x2(yuv420[1], width, height);
-  std::vector<float> v = Upsample2x2(yuv420[2], width, height);
-  yuv.push_back(Blur(u, width, height));
-  yuv.push_back(Blur(v, width, height));
-  return YUVToRGB(yuv);
-}
-
-void UpdateGuess(const std::vector<float>& target,
-                 const std::vector<float>& reconstructed,
-                 std::vector<float>* guess) {
-  assert(reconstructed.size() == guess->size());
-  assert(target.size() == guess->size());
-  for (size_t i = 0; i < guess->size(); ++i) {
-    // TODO(user): Evaluate using a decaying constant here.
-    (*guess)[i] = Clip((*guess)[i] - (reconstructed[i] - target[i]));
-  }
+  std::vector<std::vector<float> > yuv(3);
+  yuv[0].swap(y_guess);
+  yuv[1] = Upsample2x2(u_guess, width, height);
+  yuv[2] = Upsample2x2(v_guess, width, height);
+  return yuv;
 }
 
-}  // namespace
-
 std::vector<std::vector<float> > RGBToYUV420(
     const std::vector<uint8_t>& rgb_in, const int width, const int height) {
-  std::vector<float> rgbf(rgb_in.size());
-  for (size_t i = 0; i < rgb_in.size(); ++i) {
-    rgbf[i] = static_cast<float>(rgb_in[i]);
-  }
-  std::vector<float> y_target = LinearlyAveragedLuma(rgbf);
-  std::vector<std::vector<float> > yuv_target =
-      RGBToYUV(LinearlyDownsample2x2(rgbf, width, height));
-  std::vector<std::vector<float> > yuv_guess = yuv_target;
-  yuv_guess[0] = Upsample2x2(yuv_guess[0], width, height);
-  // TODO(user): Stop early if the error is small enough.
-  for (int iter = 0; iter < 20; ++iter) {
-    std::vector<float> rgb_rec = YUV420ToRGB(yuv_guess, width, height);
-    std::vector<float> y_rec = LinearlyAveragedLuma(rgb_rec);
-    std::vector<std::vector<float> > yuv_rec =
-        RGBToYUV(LinearlyDownsample2x2(rgb_rec, width, height));
-    UpdateGuess(y_target, y_rec, &yuv_guess[0]);
-    UpdateGuess(yuv_target[1], yuv_rec[1], &yuv_guess[1]);
-    UpdateGuess(yuv_target[2], yuv_rec[2], &yuv_guess[2]);
-  }
-  yuv_guess[1] = Upsample2x2(yuv_guess[1], width, height);
-  yuv_guess[2] = Upsample2x2(yuv_guess[2], width, height);
-  return yuv_guess;
+  return RGBToYUV420(rgb_in, width, height, nullptr);
 }
 
 }  // namespace guetzli
@@ -18,6 +18,10 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
 #include <set>
 #include <string.h>
 #include <time.h>
@@ -30,10 +34,20 @@
 #include "guetzli/jpeg_data_reader.h"
 #include "guetzli/jpeg_data_writer.h"
 #include "guetzli/output_image.h"
+#include "guetzli/quality.h"
 #include "guetzli/quantize.h"
+#include "guetzli/ssim_comparator.h"
+#include "guetzli/thread_pool.h"
 
 namespace guetzli {
 
+int GuetzliStringOut(void* data, const uint8_t* buf, size_t count) {
+  std::string* sink =
+      reinterpret_cast<std::string*>(data);
+  sink->append(reinterpret_cast<const char*>(buf), count);
+  return count;
+}
+
 namespace {
 
 static const size_t kBlockSize = 3 * kDCTBlockSize;
@@ -42,6 +56,28 @@ struct CoeffData {
   int idx;
   float block_err;
 };
+// The blocks that are zeroed together: one block of each component in
+// comp_mask, with the given block coordinates.
+struct ZeroingUnit {
+  uint8_t comp_mask;
+  int block_x[3];
+  int block_y[3];
+  std::vector<CoeffData> order;
+  // The number of coefficients of order that are zeroed in the output image.
+  size_t num_zeroed;
+};
+// An output subsampling mode that ProcessJpegData() tries.
+struct Candidate {
+  explicit Candidate(bool is_420) : is_420(is_420) {}
+  bool is_420;
+  std::string jpeg_data;
+  // False if the candidate could not be encoded.
+  bool ok = false;
+  bool distance_ok = false;
+  int elapsed_ms = 0;
+  ProcessStats stats;
+  std::string debug_output;
+};
 struct QuantData {
   int q[3][kDCTBlockSize];
   size_t jpg_size;
@@ -49,22 +85,49 @@ struct QuantData {
 };
 class Processor {
  public:
+  // Zeroes coefficients of jpg_in for as long as its distance from the image
+  // of reference stays within params.target_distance. If reference is null,
+  // jpg_in itself is the reference image.
   bool ProcessJpegData(const Params& params, const JPEGData& jpg_in,
+                       const SSIMComparator* reference, ThreadPool* pool,
                        GuetzliOutput* out, ProcessStats* stats);
 
  private:
+  void ComputeACBits(const JPEGData& jpg);
+  float BlockACBits(int c, const coeff_t coeffs[kDCTBlockSize]) const;
   void ComputeBlockZeroingOrder(
       const coeff_t block[kBlockSize], const coeff_t orig_block[kBlockSize],
-      const int block_x, const int block_y, const int factor_x,
-      const int factor_y, const uint8_t comp_mask, OutputImage* img,
-      std::vector<CoeffData>* output_order);
-  void OutputJpeg(const JPEGData& in, std::string* out);
+      const uint8_t comp_mask, std::vector<CoeffData>* output_order) const;
+  std::vector<ZeroingUnit> ComputeZeroingUnits(const JPEGData& jpg,
+                                               const OutputImage& img,
+                                               ThreadPool* pool) const;
+  void ApplyZeroing(const JPEGData& jpg, float block_err_limit,
+                    std::vector<ZeroingUnit>* units, OutputImage* img) const;
+  void SelectZeroingThreshold(const JPEGData& jpg, Comparator* comparator,
+                              std::vector<ZeroingUnit>* units,
+                              OutputImage* img);
+  // Zeroes the coefficients of jpg for which the distance of the result from
+  // the original image of comparator stays within the target, and sets *out to
+  // the encoded result. Returns false if the result could not be encoded.
+  bool ZeroCoefficients(const JPEGData& jpg, Comparator* comparator,
+                        ThreadPool* pool, std::string* out);
+  // Builds the YUV420 candidate from the YUV444 image img, keeping the quant
+  // tables of jpg_in.
+  void DownsampleTo420(const JPEGData& jpg_in, const OutputImage& img,
+                       ThreadPool* pool, JPEGData* jpg) const;
+  // Encodes in to *out. Prints an error message and returns false on failure.
+  bool OutputJpeg(const JPEGData& in, std::string* out);
 
   Params params_;
   GuetzliOutput* final_output_;
   ProcessStats* stats_;
+  // Estimated cost in bits of each AC symbol of each component.
+  float ac_bits_[3][256];
 };
 
+// The weights of the components in the error of a zeroing unit.
+static const float kComponentWeights[3] = { 1.0f, 0.22f, 0.20f };
+
 bool CheckJpegSanity(const JPEGData& jpg) {
   const int kMaxComponent = 1 << 12;
   for (const JPEGComponent& comp : jpg.components) {
@@ -80,26 +143,468 @@ bool CheckJpegSanity(const JPEGData& jpg) {
   return true;
 }
 
-}  // namespace
+// Forwards the output to another JPEGOutput and counts the bytes written.
+struct CountingOutput {
+  explicit CountingOutput(JPEGOutput out) : out(out), size(0) {}
+  JPEGOutput out;
+  size_t size;
+};
 
-int GuetzliStringOut(void* data, const uint8_t* buf, size_t count) {
-  std::string* sink =
-      reinterpret_cast<std::string*>(data);
-  sink->append(reinterpret_cast<const char*>(buf), count);
+int CountingOut(void* data, const uint8_t* buf, size_t count) {
+  CountingOutput* sink = reinterpret_cast<CountingOutput*>(data);
+  if (!sink->out.Write(buf, count)) {
+    return 0;
+  }
+  sink->size += count;
   return count;
 }
 
-void Processor::OutputJpeg(const JPEGData& jpg,
+bool WriteJpegWithStats(const Params& params, ProcessStats* stats,
+                        const JPEGData& jpg, size_t in_size, JPEGOutput out) {
+  CountingOutput counter(out);
+  JPEGOutput output(CountingOut, &counter);
+  bool ok = params.progressive ?
+      WriteProgressiveJpeg(jpg, params.clear_metadata, output) :
+      WriteJpeg(jpg, params.clear_metadata, output);
+  if (!ok) {
+    fprintf(stderr, "Could not write optimized jpg data\n");
+    return false;
+  }
+  stats->counters[kInputSizeCnt] = in_size;
+  stats->counters[kOutputSizeCnt] = counter.size;
+  GUETZLI_LOG(stats, "Optimized %s In[%7zd] Out[%7zd]\n",
+              params.progressive ? "progressive" : "sequential",
+              in_size, counter.size);
+  return true;
+}
+
+// Returns the quality of the standard quant tables with the largest estimated
+// size that is at most target_bytes, or 0 if even quality 1 is too large.
+// Uses regula falsi on the logarithm of the size, falling back to bisection
+// when the same end of the bracket moved twice in a row.
+int SearchTargetQuality(const DCTCoefficientCache& cache, size_t target_bytes,
+                        ThreadPool* pool, int* num_trials) {
+  auto estimate = [&cache, pool, num_trials](int quality) {
+    int q[3][kDCTBlockSize];
+    QualityToQuantTables(quality, q);
+    ++(*num_trials);
+    return cache.EstimateJpegSize(&q[0][0], pool);
+  };
+  int lo = 1;
+  int hi = 100;
+  size_t lo_size = estimate(lo);
+  if (lo_size > target_bytes) {
+    return 0;
+  }
+  size_t hi_size = estimate(hi);
+  if (hi_size <= target_bytes) {
+    return hi;
+  }
+  int last_side = 0;
+  int same_side_steps = 0;
+  while (hi - lo > 1) {
+    int quality;
+    if (same_side_steps >= 2 || hi_size <= lo_size) {
+      quality = (lo + hi) / 2;
+      same_side_steps = 0;
+    } else {
+      const double t = (std::log(target_bytes) - std::log(lo_size)) /
+          (std::log(hi_size) - std::log(lo_size));
+      quality = lo + static_cast<int>(t * (hi - lo));
+      quality = std::min(hi - 1, std::max(lo + 1, quality));
+    }
+    const size_t size = estimate(quality);
+    const int side = size <= target_bytes ? -1 : 1;
+    same_side_steps = side == last_side ? same_side_steps + 1 : 1;
+    last_side = side;
+    if (side < 0) {
+      lo = quality;
+      lo_size = size;
+    } else {
+      hi = quality;
+      hi_size = size;
+    }
+  }
+  return lo;
+}
+
+// Encodes the image in cache with the highest quality standard quant tables
+// that make the output fit in params.target_bytes. The search runs on size
+// estimates of the cached DCT coefficients; only the result is written, and
+// the quality is lowered further in the rare case the estimate was low. The
+// quantization runs on MCU rows in parallel, and the sequential writer reuses
+// the histograms counted while quantizing.
+bool EncodeToTargetSize(const Params& params, ProcessStats* stats,
+                        const DCTCoefficientCache& cache, ThreadPool* pool,
+                        std::string* jpg_out) {
+  int num_trials = 0;
+  int quality = SearchTargetQuality(cache, params.target_bytes, pool,
+                                    &num_trials);
+  for (; quality > 0; --quality) {
+    int q[3][kDCTBlockSize];
+    QualityToQuantTables(quality, q);
+    JPEGData jpg;
+    std::vector<JpegHistogram> histograms;
+    cache.Quantize(&q[0][0], pool, &jpg, &histograms);
+    jpg_out->clear();
+    JPEGOutput output(GuetzliStringOut, jpg_out);
+    bool ok = params.progressive ?
+        WriteProgressiveJpeg(jpg, params.clear_metadata, output) :
+        WriteJpegWithHistograms(jpg, params.clear_metadata, histograms,
+                                output);
+    ++num_trials;
+    if (!ok) {
+      fprintf(stderr, "Could not write jpg data\n");
+      return false;
+    }
+    if (jpg_out->size() <= params.target_bytes) {
+      break;
+    }
+  }
+  stats->counters[kTargetSizeTrialsCnt] = num_trials;
+  if (quality == 0) {
+    fprintf(stderr, "Could not fit the image in %zu bytes\n",
+            params.target_bytes);
+    return false;
+  }
+  stats->counters[kTargetSizeQualityCnt] = quality;
+  stats->counters[kOutputSizeCnt] = jpg_out->size();
+  GUETZLI_LOG(stats, "Target[%7zd] Quality[%3d] Out[%7zd] Trials[%d]\n",
+              params.target_bytes, quality, jpg_out->size(), num_trials);
+  return true;
+}
+
+}  // namespace
+
+bool Processor::OutputJpeg(const JPEGData& jpg,
                            std::string* out) {
   out->clear();
   JPEGOutput output(GuetzliStringOut, out);
-  if (!WriteJpeg(jpg, params_.clear_metadata, output)) {
-    assert(0);
+  bool ok = params_.progressive ?
+      WriteProgressiveJpeg(jpg, params_.clear_metadata, output) :
+      WriteJpeg(jpg, params_.clear_metadata, output);
+  if (!ok) {
+    fprintf(stderr, "Could not write jpg data\n");
+  }
+  return ok;
+}
+
+// Estimates the cost of the AC symbols of each component from the symbol
+// frequencies of jpg.
+void Processor::ComputeACBits(const JPEGData& jpg) {
+  std::vector<JpegHistogram> histograms(jpg.components.size());
+  BuildACHistograms(jpg, &histograms[0]);
+  for (size_t c = 0; c < jpg.components.size(); ++c) {
+    // JpegHistogram::Add() counts every symbol twice, and there is a fake
+    // symbol at the end.
+    double total = 0.0;
+    for (int i = 0; i < 256; ++i) total += histograms[c].counts[i] / 2;
+    for (int i = 0; i < 256; ++i) {
+      ac_bits_[c][i] = static_cast<float>(
+          std::log2((total + 256.0) / (histograms[c].counts[i] / 2 + 1.0)));
+    }
   }
 }
 
+// Returns the estimated number of bits of the AC coefficients of a quantized
+// block of component c in a sequential jpeg.
+float Processor::BlockACBits(int c, const coeff_t coeffs[kDCTBlockSize]) const {
+  const float* bits = ac_bits_[c];
+  float total = 0.0f;
+  int r = 0;
+  for (int k = 1; k < kDCTBlockSize; ++k) {
+    const int coeff = coeffs[kJPEGNaturalOrder[k]];
+    if (coeff == 0) {
+      r++;
+      continue;
+    }
+    while (r > 15) {
+      total += bits[0xf0];
+      r -= 16;
+    }
+    const int nbits = Log2FloorNonZero(std::abs(coeff)) + 1;
+    total += bits[(r << 4) + nbits] + nbits;
+    r = 0;
+  }
+  if (r > 0) {
+    total += bits[0];
+  }
+  return total;
+}
+
+// Computes the order in which the AC coefficients of the blocks in comp_mask
+// are zeroed, together with the error of the blocks after each step. block[]
+// holds the quantized and orig_block[] the dequantized coefficients.
+//
+// The error of a component block is 1 - SSIM of the block in the
+// dequantized DCT domain. Since the DCT is orthonormal and zeroing does not
+// change the mean, this is E / (2 * S - E + 64 * C2), where S is the AC
+// energy of the block and E the energy of the zeroed coefficients.
+//
+// The candidates are ranked once by a static estimate, and each greedy step
+// picks the candidate with the most bits saved per unit of error among the
+// first zeroing_greedy_lookahead candidates of this ranking.
+void Processor::ComputeBlockZeroingOrder(
+    const coeff_t block[kBlockSize], const coeff_t orig_block[kBlockSize],
+    const uint8_t comp_mask, std::vector<CoeffData>* output_order) const {
+  float energy[3] = { 0.0f };
+  float weight_sum = 0.0f;
+  for (int c = 0; c < 3; ++c) {
+    if (!(comp_mask & (1 << c))) continue;
+    weight_sum += kComponentWeights[c];
+    for (int k = 1; k < kDCTBlockSize; ++k) {
+      const float v = orig_block[c * kDCTBlockSize + k];
+      energy[c] += v * v;
+    }
+  }
+  auto block_error = [&energy, weight_sum](const float removed[3]) {
+    float err = 0.0f;
+    for (int c = 0; c < 3; ++c) {
+      if (removed[c] > 0.0f) {
+        err += kComponentWeights[c] * removed[c] /
+            (2 * energy[c] - removed[c] + kDCTBlockSize * kSSIMC2);
+      }
+    }
+    return err / weight_sum;
+  };
+
+  std::vector<std::pair<int, float> > input_order;
+  for (int c = 0; c < 3; ++c) {
+    if (!(comp_mask & (1 << c))) continue;
+    const coeff_t* coeffs = &block[c * kDCTBlockSize];
+    int r = 0;
+    for (int k = 1; k < kDCTBlockSize; ++k) {
+      const int natural_k = kJPEGNaturalOrder[k];
+      const int idx = c * kDCTBlockSize + natural_k;
+      const int coeff = coeffs[natural_k];
+      if (coeff == 0) {
+        r++;
+        continue;
+      }
+      const float v = orig_block[idx];
+      float score;
+      if (params_.new_zeroing_model) {
+        // Descending bits per error of the coefficient on its own.
+        const int nbits = Log2FloorNonZero(std::abs(coeff)) + 1;
+        const float bits = ac_bits_[c][(std::min(r, 15) << 4) + nbits] + nbits;
+        score = -bits / (kComponentWeights[c] * v * v);
+      } else {
+        score = (std::abs(v) - k / 64.0f) * kComponentWeights[c];
+      }
+      input_order.push_back(std::make_pair(idx, score));
+      r = 0;
+    }
+  }
+  std::stable_sort(input_order.begin(), input_order.end(),
+                   [](const std::pair<int, float>& a,
+                      const std::pair<int, float>& b) {
+                     return a.second < b.second; });
+
+  coeff_t processed_block[kBlockSize];
+  memcpy(processed_block, block, sizeof(processed_block));
+  float block_bits[3] = { 0.0f };
+  for (int c = 0; c < 3; ++c) {
+    if (comp_mask & (1 << c)) {
+      block_bits[c] = BlockACBits(c, &processed_block[c * kDCTBlockSize]);
+    }
+  }
+  float removed[3] = { 0.0f };
+  float current_err = 0.0f;
+  const size_t lookahead = std::max(1, params_.zeroing_greedy_lookahead);
+  while (!input_order.empty()) {
+    size_t best_i = 0;
+    float best_ratio = 0.0f;
+    float best_err = 0.0f;
+    float best_bits = 0.0f;
+    for (size_t i = 0; i < std::min(lookahead, input_order.size()); ++i) {
+      const int idx = input_order[i].first;
+      const int c = idx / kDCTBlockSize;
+      const coeff_t coeff = processed_block[idx];
+      processed_block[idx] = 0;
+      const float bits = BlockACBits(c, &processed_block[c * kDCTBlockSize]);
+      processed_block[idx] = coeff;
+      float candidate_removed[3] = { removed[0], removed[1], removed[2] };
+      candidate_removed[c] += static_cast<float>(orig_block[idx]) *
+          orig_block[idx];
+      const float err = block_error(candidate_removed);
+      const float ratio = ((block_bits[c] - bits) /
+                           std::max(err - current_err, 1e-12f));
+      if (i == 0 || ratio > best_ratio) {
+        best_i = i;
+        best_ratio = ratio;
+        best_err = err;
+        best_bits = bits;
+      }
+    }
+    const int idx = input_order[best_i].first;
+    const int c = idx / kDCTBlockSize;
+    processed_block[idx] = 0;
+    removed[c] += static_cast<float>(orig_block[idx]) * orig_block[idx];
+    block_bits[c] = best_bits;
+    current_err = best_err;
+    input_order.erase(input_order.begin() + best_i);
+    output_order->push_back({idx, best_err});
+  }
+  // Make the block error values monotonic.
+  float min_err = 1e10;
+  for (int i = static_cast<int>(output_order->size()) - 1; i >= 0; --i) {
+    min_err = std::min(min_err, (*output_order)[i].block_err);
+    (*output_order)[i].block_err = min_err;
+  }
+}
+
+// Splits the visible blocks of jpg into zeroing units, the blocks of all
+// components of an MCU for 4:4:4 and grayscale images and each luma block and
+// the two chroma blocks of an MCU for 4:2:0 images, and computes their zeroing
+// order. The MCU rows are processed in parallel.
+std::vector<ZeroingUnit> Processor::ComputeZeroingUnits(
+    const JPEGData& jpg, const OutputImage& img, ThreadPool* pool) const {
+  const bool is_420 = jpg.Is420();
+  const int num_components = jpg.components.size();
+  std::vector<ZeroingUnit> units;
+  std::vector<size_t> row_start(jpg.MCU_rows + 1);
+  for (int mcu_y = 0; mcu_y < jpg.MCU_rows; ++mcu_y) {
+    row_start[mcu_y] = units.size();
+    for (int mcu_x = 0; mcu_x < jpg.MCU_cols; ++mcu_x) {
+      ZeroingUnit unit;
+      unit.num_zeroed = 0;
+      if (is_420) {
+        for (int iy = 0; iy < 2; ++iy) {
+          for (int ix = 0; ix < 2; ++ix) {
+            unit.comp_mask = 1;
+            unit.block_x[0] = 2 * mcu_x + ix;
+            unit.block_y[0] = 2 * mcu_y + iy;
+            if (unit.block_x[0] < img.component(0).width_in_blocks() &&
+                unit.block_y[0] < img.component(0).height_in_blocks()) {
+              units.push_back(unit);
+            }
+          }
+        }
+        unit.comp_mask = 6;
+      } else {
+        unit.comp_mask = (1 << num_components) - 1;
+      }
+      for (int c = is_420 ? 1 : 0; c < num_components; ++c) {
+        unit.block_x[c] = mcu_x;
+        unit.block_y[c] = mcu_y;
+      }
+      const OutputImageComponent& mcu_comp = img.component(is_420 ? 1 : 0);
+      if (mcu_x < mcu_comp.width_in_blocks() &&
+          mcu_y < mcu_comp.height_in_blocks()) {
+        units.push_back(unit);
+      }
+    }
+  }
+  row_start[jpg.MCU_rows] = units.size();
+
+  ParallelFor(pool, jpg.MCU_rows, [&](int mcu_y) {
+    for (size_t i = row_start[mcu_y]; i < row_start[mcu_y + 1]; ++i) {
+      ZeroingUnit* unit = &units[i];
+      coeff_t block[kBlockSize] = { 0 };
+      coeff_t orig_block[kBlockSize] = { 0 };
+      for (int c = 0; c < num_components; ++c) {
+        if (!(unit->comp_mask & (1 << c))) continue;
+        const JPEGComponent& comp = jpg.components[c];
+        const int* quant = &jpg.quant[comp.quant_idx].values[0];
+        const int block_idx = (unit->block_y[c] * comp.width_in_blocks +
+                               unit->block_x[c]);
+        const coeff_t* coeffs = &comp.coeffs[block_idx * kDCTBlockSize];
+        for (int k = 0; k < kDCTBlockSize; ++k) {
+          block[c * kDCTBlockSize + k] = coeffs[k];
+          orig_block[c * kDCTBlockSize + k] = coeffs[k] * quant[k];
+        }
+      }
+      ComputeBlockZeroingOrder(block, orig_block, unit->comp_mask,
+                               &unit->order);
+    }
+  });
+  return units;
+}
+
+// Zeroes the coefficients of each unit whose block error is at most
+// block_err_limit in *img, restoring the ones that were zeroed before but
+// are not anymore. Only the changed blocks are set in *img.
+void Processor::ApplyZeroing(const JPEGData& jpg, float block_err_limit,
+                             std::vector<ZeroingUnit>* units,
+                             OutputImage* img) const {
+  // A zeroing unit holds the blocks of at most three components.
+  const int num_components = std::min<int>(jpg.components.size(),
+                                           kBlockSize / kDCTBlockSize);
+  for (ZeroingUnit& unit : *units) {
+    size_t num_zeroed = 0;
+    while (num_zeroed < unit.order.size() &&
+           unit.order[num_zeroed].block_err <= block_err_limit) {
+      ++num_zeroed;
+    }
+    if (num_zeroed == unit.num_zeroed) continue;
+    unit.num_zeroed = num_zeroed;
+    coeff_t block[kBlockSize];
+    for (int c = 0; c < num_components; ++c) {
+      if (!(unit.comp_mask & (1 << c))) continue;
+      const JPEGComponent& comp = jpg.components[c];
+      const int block_idx = (unit.block_y[c] * comp.width_in_blocks +
+                             unit.block_x[c]);
+      memcpy(&block[c * kDCTBlockSize],
+             &comp.coeffs[block_idx * kDCTBlockSize],
+             kDCTBlockSize * sizeof(block[0]));
+    }
+    for (size_t i = 0; i < num_zeroed; ++i) {
+      block[unit.order[i].idx] = 0;
+    }
+    for (int c = 0; c < num_components; ++c) {
+      if (!(unit.comp_mask & (1 << c))) continue;
+      const int* quant = &jpg.quant[jpg.components[c].quant_idx].values[0];
+      coeff_t* coeffs = &block[c * kDCTBlockSize];
+      for (int k = 0; k < kDCTBlockSize; ++k) {
+        coeffs[k] *= quant[k];
+      }
+      img->component(c).SetCoeffBlock(unit.block_x[c], unit.block_y[c],
+                                      coeffs);
+    }
+  }
+}
+
+// Searches for the largest block error limit for which the distance of the
+// zeroed image stays within params_.target_distance, and leaves *img and the
+// num_zeroed fields of *units at that limit.
+void Processor::SelectZeroingThreshold(const JPEGData& jpg,
+                                       Comparator* comparator,
+                                       std::vector<ZeroingUnit>* units,
+                                       OutputImage* img) {
+  static const int kNumIterations = 16;
+  float max_err = 0.0f;
+  for (const ZeroingUnit& unit : *units) {
+    if (!unit.order.empty()) {
+      max_err = std::max(max_err, unit.order.back().block_err);
+    }
+  }
+  float lo = 0.0f;
+  float hi = max_err;
+  for (int i = 0; i <= kNumIterations && hi > 0.0f; ++i) {
+    // The first iteration tries to zero everything.
+    const float limit = i == 0 ? hi : 0.5f * (lo + hi);
+    ApplyZeroing(jpg, limit, units, img);
+    comparator->CompareDirty(img);
+    const bool ok = comparator->DistanceOK(params_.target_distance);
+    ++stats_->counters[kNumItersCnt];
+    ++stats_->counters[ok ? kNumItersUpCnt : kNumItersDownCnt];
+    GUETZLI_LOG(stats_, "Zeroing limit[%8.6f] Dist[%8.6f] %s\n", limit,
+                comparator->distance(), ok ? "ok" : "over");
+    if (ok) {
+      lo = limit;
+      if (i == 0) break;
+    } else {
+      hi = limit;
+    }
+  }
+  ApplyZeroing(jpg, lo, units, img);
+  comparator->CompareDirty(img);
+}
+
 bool Processor::ProcessJpegData(const Params& params, const JPEGData& jpg_in,
-                                GuetzliOutput* out, ProcessStats* stats) {
+                                const SSIMComparator* reference,
+                                ThreadPool* pool, GuetzliOutput* out,
+                                ProcessStats* stats) {
   params_ = params;
   final_output_ = out;
   stats_ = stats;
@@ -122,22 +627,159 @@ bool Processor::ProcessJpegData(const Params& params, const JPEGData& jpg_in,
     fprintf(stderr, "\n");
     return false;
   }
-  int q_in[3][kDCTBlockSize];
   // Output the original image, in case we do not manage to create anything
   // with a good enough quality.
   std::string encoded_jpg;
-  OutputJpeg(jpg_in, &encoded_jpg);
+  if (!OutputJpeg(jpg_in, &encoded_jpg)) {
+    return false;
+  }
   final_output_->score = -1;
-  GUETZLI_LOG(stats, "Original Out[%7zd]", encoded_jpg.size());
+  GUETZLI_LOG(stats, "Original Out[%7zd]\n", encoded_jpg.size());
   final_output_->jpeg_data = encoded_jpg;
   final_output_->score = encoded_jpg.size();
+
+  OutputImage img(jpg_in.width, jpg_in.height);
+  img.CopyFromJpegData(jpg_in);
+  // The candidates are compared to the same reference image, so they share
+  // its linear RGB planes.
+  std::unique_ptr<SSIMComparator> decoded_input;
+  if (reference == nullptr) {
+    decoded_input.reset(
+        new SSIMComparator(img.ToSRGB(), img.width(), img.height(), pool));
+    reference = decoded_input.get();
+  }
+
+  std::vector<Candidate> candidates;
+  if (input_is_420 || !params.force_420) {
+    candidates.emplace_back(input_is_420);
+  }
+  if (!input_is_420 && (params.try_420 || params.force_420)) {
+    candidates.emplace_back(true);
+  }
+  // Each candidate runs on its own thread, and its zeroing search uses the
+  // rest of the pool.
+  ParallelFor(pool, candidates.size(), [&](int i) {
+    Candidate* cand = &candidates[i];
+    const auto start = std::chrono::steady_clock::now();
+    Processor processor;
+    processor.params_ = params_;
+    processor.final_output_ = nullptr;
+    processor.stats_ = &cand->stats;
+    cand->stats.debug_output = &cand->debug_output;
+    SSIMComparator comparator(*reference, pool);
+    if (cand->is_420 && !input_is_420) {
+      JPEGData jpg;
+      DownsampleTo420(jpg_in, img, pool, &jpg);
+      cand->ok = processor.ZeroCoefficients(jpg, &comparator, pool,
+                                            &cand->jpeg_data);
+    } else {
+      cand->ok = processor.ZeroCoefficients(jpg_in, &comparator, pool,
+                                            &cand->jpeg_data);
+    }
+    cand->distance_ok = comparator.DistanceOK(params_.target_distance);
+    cand->elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  });
+
+  for (const Candidate& cand : candidates) {
+    GUETZLI_LOG(stats, "%s candidate:\n", cand.is_420 ? "YUV420" : "YUV444");
+    PrintDebug(stats, cand.debug_output);
+    for (const auto& counter : cand.stats.counters) {
+      stats->counters[counter.first] += counter.second;
+    }
+    if (!cand.ok) {
+      return false;
+    }
+    stats->counters[cand.is_420 ? k420SizeCnt : k444SizeCnt] =
+        cand.jpeg_data.size();
+    stats->counters[cand.is_420 ? k420TimeCnt : k444TimeCnt] =
+        cand.elapsed_ms;
+    // A forced YUV420 output is kept even if it is too far from the input.
+    const bool forced = params.force_420 && cand.is_420;
+    if (forced || (cand.distance_ok &&
+                   cand.jpeg_data.size() < final_output_->score)) {
+      final_output_->jpeg_data = cand.jpeg_data;
+      final_output_->score = cand.jpeg_data.size();
+    }
+  }
+  return true;
+}
+
+void Processor::DownsampleTo420(const JPEGData& jpg_in, const OutputImage& img,
+                                ThreadPool* pool, JPEGData* jpg) const {
+  OutputImage img420 = img;
+  DownsampleConfig cfg;
+  cfg.use_silver_screen = params_.use_silver_screen;
+  img420.Downsample(cfg, pool);
+  int q[3][kDCTBlockSize];
+  for (int c = 0; c < 3; ++c) {
+    const JPEGQuantTable& table = jpg_in.quant[jpg_in.components[c].quant_idx];
+    std::copy(table.values.begin(), table.values.end(), &q[c][0]);
+  }
+  img420.ApplyGlobalQuantization(q);
+  img420.SaveToJpegData(jpg);
+  jpg->app_data = jpg_in.app_data;
+  jpg->com_data = jpg_in.com_data;
+}
+
+bool Processor::ZeroCoefficients(const JPEGData& jpg_in,
+                                 Comparator* comparator, ThreadPool* pool,
+                                 std::string* out) {
+  OutputImage img(jpg_in.width, jpg_in.height);
+  img.CopyFromJpegData(jpg_in);
+  comparator->CompareDirty(&img);
+
+  // Zeroing only adds to the distance, so there is nothing to search for if
+  // the quantized image is already too far from the reference.
+  std::vector<ZeroingUnit> units;
+  if (comparator->DistanceOK(params_.target_distance)) {
+    ComputeACBits(jpg_in);
+    units = ComputeZeroingUnits(jpg_in, img, pool);
+    SelectZeroingThreshold(jpg_in, comparator, &units, &img);
+  }
+
+  JPEGData jpg = jpg_in;
+  for (const ZeroingUnit& unit : units) {
+    for (size_t i = 0; i < unit.num_zeroed; ++i) {
+      const int c = unit.order[i].idx / kDCTBlockSize;
+      const int k = unit.order[i].idx % kDCTBlockSize;
+      JPEGComponent* comp = &jpg.components[c];
+      const int block_idx = (unit.block_y[c] * comp->width_in_blocks +
+                             unit.block_x[c]);
+      comp->coeffs[block_idx * kDCTBlockSize + k] = 0;
+    }
+  }
+  // The blocks that only pad the image to whole MCUs are not visible, so
+  // their AC coefficients can be dropped.
+  for (size_t c = 0; c < jpg.components.size(); ++c) {
+    JPEGComponent* comp = &jpg.components[c];
+    const OutputImageComponent& out_comp = img.component(c);
+    for (int block_y = 0; block_y < comp->height_in_blocks; ++block_y) {
+      for (int block_x = 0; block_x < comp->width_in_blocks; ++block_x) {
+        if (block_x < out_comp.width_in_blocks() &&
+            block_y < out_comp.height_in_blocks()) {
+          continue;
+        }
+        coeff_t* coeffs = &comp->coeffs[
+            (block_y * comp->width_in_blocks + block_x) * kDCTBlockSize];
+        std::fill(coeffs + 1, coeffs + kDCTBlockSize, 0);
+      }
+    }
+  }
+  if (!OutputJpeg(jpg, out)) {
+    return false;
+  }
+  GUETZLI_LOG(stats_, "Zeroed Out[%7zd] Dist[%8.6f]\n", out->size(),
+              comparator->distance());
   return true;
 }
 
 bool ProcessJpegData(const Params& params, const JPEGData& jpg_in,
                      GuetzliOutput* out, ProcessStats* stats) {
+  ThreadPool pool(params.num_threads > 0 ? params.num_threads :
+                  ThreadPool::DefaultNumThreads());
   Processor processor;
-  return processor.ProcessJpegData(params, jpg_in, out, stats);
+  return processor.ProcessJpegData(params, jpg_in, nullptr, &pool, out, stats);
 }
 
 bool Process(const Params& params, ProcessStats* stats,
@@ -153,8 +795,7 @@ bool Process(const Params& params, ProcessStats* stats,
             "values).\n");
     return false;
   }
-  std::vector<uint8_t> rgb = DecodeJpegToRGB(jpg);
-  if (rgb.empty()) {
+  if (!CanDecodeJpegToRGB(jpg)) {
     fprintf(stderr, "Unsupported input JPEG file (e.g. unsupported "
             "downsampling mode).\nPlease provide the input image as "
             "a PNG file.\n");
@@ -165,32 +806,132 @@ bool Process(const Params& params, ProcessStats* stats,
   if (stats == nullptr) {
     stats = &dummy_stats;
   }
+  if (params.target_bytes > 0) {
+    std::vector<uint8_t> rgb = DecodeJpegToRGB(jpg);
+    return Process(params, stats, rgb, jpg.width, jpg.height, jpg_out);
+  }
   bool ok = ProcessJpegData(params, jpg, &out, stats);
   *jpg_out = out.jpeg_data;
   return ok;
 }
 
-bool Process(const Params& params, ProcessStats* stats,
-             const std::vector<uint8_t>& rgb, int w, int h,
-             std::string* jpg_out) {
+bool OptimizeJpeg(const Params& params, ProcessStats* stats,
+                  const std::string& in_data, JPEGOutput out) {
   JPEGData jpg;
+  if (!ReadJpeg(in_data, JPEG_READ_ALL, &jpg)) {
+    fprintf(stderr, "Can't read jpg data from input file\n");
+    return false;
+  }
+  if (!CheckJpegSanity(jpg)) {
+    fprintf(stderr, "Unsupported input JPEG (unexpectedly large coefficient "
+            "values).\n");
+    return false;
+  }
+  ProcessStats dummy_stats;
+  if (stats == nullptr) {
+    stats = &dummy_stats;
+  }
+  return WriteJpegWithStats(params, stats, jpg, in_data.size(), out);
+}
 
-  clock_t start, end;
-  start = clock();
-  if (!EncodeRGBToJpeg(rgb, w, h, &jpg)) {
-    fprintf(stderr, "Could not create jpg data from rgb pixels\n");
+bool RequantizeJpeg(const Params& params, ProcessStats* stats,
+                    const std::string& in_data, int quality, float dead_zone,
+                    JPEGOutput out) {
+  JPEGData jpg_in;
+  if (!ReadJpeg(in_data, JPEG_READ_ALL, &jpg_in)) {
+    fprintf(stderr, "Can't read jpg data from input file\n");
+    return false;
+  }
+  if (!CheckJpegSanity(jpg_in)) {
+    fprintf(stderr, "Unsupported input JPEG (unexpectedly large coefficient "
+            "values).\n");
+    return false;
+  }
+  JPEGData jpg;
+  if (!RequantizeJpegData(jpg_in, quality, dead_zone, &jpg)) {
+    fprintf(stderr, "Only jpegs with at most 3 components can be "
+            "requantized\n");
     return false;
   }
-  end = clock();
-  printf("Took %f seconds to encode JPEG\n", ((double) (end - start)) / CLOCKS_PER_SEC);
-  GuetzliOutput out;
   ProcessStats dummy_stats;
   if (stats == nullptr) {
     stats = &dummy_stats;
   }
-  bool ok = ProcessJpegData(params, jpg, &out, stats);
+  return WriteJpegWithStats(params, stats, jpg, in_data.size(), out);
+}
+
+namespace {
+
+// Runs the guetzli search, or the --target-bytes search, on the image that
+// init_cache() puts in a DCTCoefficientCache.
+bool ProcessPixels(
+    const Params& params, ProcessStats* stats,
+    const std::function<bool(ThreadPool*, DCTCoefficientCache*)>& init_cache,
+    std::string* jpg_out) {
+  ProcessStats dummy_stats;
+  if (stats == nullptr) {
+    stats = &dummy_stats;
+  }
+  ThreadPool pool(params.num_threads > 0 ? params.num_threads :
+                  ThreadPool::DefaultNumThreads());
+  DCTCoefficientCache cache;
+  const auto start = std::chrono::steady_clock::now();
+  if (!init_cache(&pool, &cache)) {
+    fprintf(stderr, "Could not create jpg data from pixels\n");
+    return false;
+  }
+  if (params.target_bytes > 0) {
+    return EncodeToTargetSize(params, stats, cache, &pool, jpg_out);
+  }
+  // The zeroing search starts from the standard quant tables of the quality
+  // of params.target_distance, and measures the distance from the image with
+  // the full precision of the DCT, which has unit quant tables.
+  const int quality = static_cast<int>(
+      std::round(QualityForDistance(params.target_distance)));
+  int q[3][kDCTBlockSize];
+  JPEGData jpg_full;
+  QualityToQuantTables(100, q);
+  cache.Quantize(&q[0][0], &pool, &jpg_full, nullptr);
+  JPEGData jpg;
+  QualityToQuantTables(quality, q);
+  cache.Quantize(&q[0][0], &pool, &jpg, nullptr);
+  GUETZLI_LOG(stats, "Took %f seconds to encode JPEG\n",
+              std::chrono::duration<double>(
+                  std::chrono::steady_clock::now() - start).count());
+  GUETZLI_LOG(stats, "Quality[%3d]\n", quality);
+  OutputImage img(jpg_full.width, jpg_full.height);
+  img.CopyFromJpegData(jpg_full);
+  SSIMComparator reference(img.ToSRGB(), img.width(), img.height(), &pool);
+  GuetzliOutput out;
+  Processor processor;
+  bool ok = processor.ProcessJpegData(params, jpg, &reference, &pool, &out,
+                                      stats);
   *jpg_out = out.jpeg_data;
   return ok;
 }
 
+}  // namespace
+
+bool Process(const Params& params, ProcessStats* stats,
+             const std::vector<uint8_t>& rgb, int w, int h,
+             std::string* jpg_out) {
+  return ProcessPixels(
+      params, stats,
+      [&rgb, w, h](ThreadPool* pool, DCTCoefficientCache* cache) {
+        return cache->Init(rgb, w, h, pool);
+      },
+      jpg_out);
+}
+
+bool ProcessYUV(const Params& params, ProcessStats* stats,
+                const std::vector<uint8_t>& yuv, int w, int h, bool is_420,
+                std::string* jpg_out) {
+  return ProcessPixels(
+      params, stats,
+      [&yuv, w, h, is_420](ThreadPool* pool, DCTCoefficientCache* cache) {
+        return cache->InitFromYUV(yuv, w, h, is_420, pool);
+      },
+      jpg_out);
+}
+
 }  // namespace guetzli
@@ -21,6 +21,7 @@
 #include <vector>
 
 #include "guetzli/jpeg_data.h"
+#include "guetzli/jpeg_data_writer.h"
 #include "guetzli/stats.h"
 
 namespace guetzli {
@@ -32,6 +33,17 @@ struct Params {
   bool use_silver_screen = false;
   int zeroing_greedy_lookahead = 3;
   bool new_zeroing_model = true;
+  // The largest SSIMComparator distance of the output from the input image,
+  // see DistanceForQuality(). The default corresponds to quality 95. Pixel
+  // inputs are first quantized with the standard quant tables of the quality
+  // of this distance.
+  double target_distance = 0.012;
+  // The number of threads to use, or 0 for one per hardware thread.
+  int num_threads = 0;
+  bool progressive = false;
+  // If positive, the output is the highest quality encoding with standard
+  // quant tables whose size is at most this many bytes.
+  size_t target_bytes = 0;
 };
 
 bool Process(const Params& params, ProcessStats* stats,
@@ -52,6 +64,25 @@ bool Process(const Params& params, ProcessStats* stats,
              const std::vector<uint8_t>& rgb, int w, int h,
              std::string* out);
 
+// Same as above, but for a planar YCbCr image, see YUVImageSize(). A 4:2:0
+// image is encoded with 4:2:0 chroma subsampling.
+bool ProcessYUV(const Params& params, ProcessStats* stats,
+                const std::vector<uint8_t>& yuv, int w, int h, bool is_420,
+                std::string* out);
+
+// Losslessly re-encodes the jpeg in in_data with optimal Huffman codes, as a
+// progressive jpeg if params.progressive is set, and streams it to out. The
+// DCT coefficients are not changed. Stores the input and output sizes in the
+// kInputSizeCnt and kOutputSizeCnt counters of *stats.
+bool OptimizeJpeg(const Params& params, ProcessStats* stats,
+                  const std::string& in_data, JPEGOutput out);
+
+// Same as OptimizeJpeg(), but first moves the coefficients to the quant
+// tables of the given libjpeg quality with RequantizeJpegData().
+bool RequantizeJpeg(const Params& params, ProcessStats* stats,
+                    const std::string& in_data, int quality, float dead_zone,
+                    JPEGOutput out);
+
 }  // namespace guetzli
 
 #endif  // GUETZLI_PROCESSOR_H_
@@ -0,0 +1,33 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GUETZLI_QUALITY_H_
+#define GUETZLI_QUALITY_H_
+
+namespace guetzli {
+
+// Returns the SSIMComparator distance that libjpeg output at the given
+// quality typically has from its source image. Qualities outside of the
+// 50-100 range are clamped to it.
+double DistanceForQuality(double quality);
+
+// The inverse of DistanceForQuality(): returns the quality in the 50-100
+// range whose distance is the given one.
+double QualityForDistance(double distance);
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_QUALITY_H_
@@ -16,8 +16,53 @@
 
 #include "guetzli/quantize.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
 namespace guetzli {
 
+namespace {
+
+// Tables K.1 and K.2 of the JPEG standard, in natural order.
+static const int kStdLumaQuant[kDCTBlockSize] = {
+  16,  11,  10,  16,  24,  40,  51,  61,
+  12,  12,  14,  19,  26,  58,  60,  55,
+  14,  13,  16,  24,  40,  57,  69,  56,
+  14,  17,  22,  29,  51,  87,  80,  62,
+  18,  22,  37,  56,  68, 109, 103,  77,
+  24,  35,  55,  64,  81, 104, 113,  92,
+  49,  64,  78,  87, 103, 121, 120, 101,
+  72,  92,  95,  98, 112, 100, 103,  99,
+};
+
+static const int kStdChromaQuant[kDCTBlockSize] = {
+  17,  18,  24,  47,  99,  99,  99,  99,
+  18,  21,  26,  66,  99,  99,  99,  99,
+  24,  26,  56,  99,  99,  99,  99,  99,
+  47,  66,  99,  99,  99,  99,  99,  99,
+  99,  99,  99,  99,  99,  99,  99,  99,
+  99,  99,  99,  99,  99,  99,  99,  99,
+  99,  99,  99,  99,  99,  99,  99,  99,
+  99,  99,  99,  99,  99,  99,  99,  99,
+};
+
+// The largest coefficient magnitudes a baseline jpeg can encode.
+static const int kMaxDCCoeff = 2047;
+static const int kMaxACCoeff = 1023;
+
+coeff_t Requantize(int value, int quant, int zero_limit) {
+  const int abs_value = std::abs(value);
+  if (abs_value < zero_limit) {
+    return 0;
+  }
+  const int abs_coeff = (2 * abs_value + quant) / (2 * quant);
+  return value < 0 ? -abs_coeff : abs_coeff;
+}
+
+}  // namespace
+
 bool QuantizeBlock(coeff_t block[kDCTBlockSize],
                    const int q[kDCTBlockSize]) {
   bool changed = false;
@@ -29,4 +74,54 @@ bool QuantizeBlock(coeff_t block[kDCTBlockSize],
   return changed;
 }
 
+void QualityToQuantTables(int quality, int q[3][kDCTBlockSize]) {
+  quality = std::min(100, std::max(1, quality));
+  const int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+  for (int c = 0; c < 3; ++c) {
+    const int* base = c == 0 ? kStdLumaQuant : kStdChromaQuant;
+    for (int k = 0; k < kDCTBlockSize; ++k) {
+      q[c][k] = std::min(255, std::max(1, (base[k] * scale + 50) / 100));
+    }
+  }
+}
+
+bool RequantizeJpegData(const JPEGData& jpg_in, const int q[3][kDCTBlockSize],
+                        float dead_zone, JPEGData* jpg_out) {
+  if (jpg_in.components.size() > 3) {
+    return false;
+  }
+  *jpg_out = jpg_in;
+  int q_out[3][kDCTBlockSize];
+  memcpy(q_out, q, sizeof(q_out));
+  for (size_t i = 0; i < jpg_in.components.size(); ++i) {
+    const JPEGComponent& c = jpg_in.components[i];
+    const std::vector<int>& q_in = jpg_in.quant[c.quant_idx].values;
+    int zero_limit[kDCTBlockSize];
+    for (int k = 0; k < kDCTBlockSize; ++k) {
+      // Requantizing to a finer quant value would only add rounding error.
+      q_out[i][k] = std::max(q_in[k], q[i][k]);
+      zero_limit[k] = k == 0 ? 0 : static_cast<int>(
+          std::ceil((0.5f + dead_zone) * q_out[i][k]));
+    }
+    coeff_t* coeffs = &jpg_out->components[i].coeffs[0];
+    for (size_t j = 0; j < c.coeffs.size(); j += kDCTBlockSize) {
+      for (int k = 0; k < kDCTBlockSize; ++k) {
+        const int max_coeff = k == 0 ? kMaxDCCoeff : kMaxACCoeff;
+        const int coeff = Requantize(c.coeffs[j + k] * q_in[k], q_out[i][k],
+                                     zero_limit[k]);
+        coeffs[j + k] = std::min(max_coeff, std::max(-max_coeff, coeff));
+      }
+    }
+  }
+  SaveQuantTables(q_out, jpg_out);
+  return true;
+}
+
+bool RequantizeJpegData(const JPEGData& jpg_in, int quality, float dead_zone,
+                        JPEGData* jpg_out) {
+  int q[3][kDCTBlockSize];
+  QualityToQuantTables(quality, q);
+  return RequantizeJpegData(jpg_in, q, dead_zone, jpg_out);
+}
+
 }  // namespace guetzli
@@ -30,6 +30,25 @@ inline coeff_t Quantize(coeff_t raw_coeff, int quant) {
 
 bool QuantizeBlock(coeff_t block[kDCTBlockSize], const int q[kDCTBlockSize]);
 
+// Fills in q with the example tables of the JPEG standard scaled to the given
+// libjpeg quality (1..100): the luma table for the first component and the
+// chroma table for the other two.
+void QualityToQuantTables(int quality, int q[3][kDCTBlockSize]);
+
+// Moves the coefficients of jpg_in to the quantization tables q, one per
+// component, without decoding to pixels. Quant values finer than those of
+// jpg_in are kept at the value of jpg_in. Each coefficient is dequantized with
+// its old table and rounded to the nearest multiple of the new quant value,
+// except that AC values within (0.5 + dead_zone) * quant of zero become zero,
+// and clamped to the range of baseline jpeg.
+// Returns false if jpg_in has more than three components.
+bool RequantizeJpegData(const JPEGData& jpg_in, const int q[3][kDCTBlockSize],
+                        float dead_zone, JPEGData* jpg_out);
+
+// Same as above, with the tables of QualityToQuantTables(quality).
+bool RequantizeJpegData(const JPEGData& jpg_in, int quality, float dead_zone,
+                        JPEGData* jpg_out);
+
 }  // namespace guetzli
 
 #endif  // GUETZLI_QUANTIZE_H_
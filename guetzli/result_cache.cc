@@ -0,0 +1,252 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "guetzli/result_cache.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include "guetzli/debug_print.h"
+
+namespace guetzli {
+
+namespace {
+
+static const char kEntrySuffix[] = ".jpg";
+static const size_t kEntryNameLength = 16 + sizeof(kEntrySuffix) - 1;
+static const char kTmpSuffix[] = ".tmp";
+// Temporary files older than this are assumed to be left behind by a writer
+// that died before renaming them.
+static const time_t kStaleTmpSeconds = 3600;
+
+// MurmurHash64A, by Austin Appleby.
+uint64_t Hash64(const void* data, size_t len, uint64_t seed) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  uint64_t h = seed ^ (len * m);
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  const uint8_t* end = p + (len & ~static_cast<size_t>(7));
+  for (; p != end; p += 8) {
+    uint64_t k;
+    memcpy(&k, p, sizeof(k));
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  switch (len & 7) {
+    case 7: h ^= static_cast<uint64_t>(p[6]) << 48;  // fallthrough
+    case 6: h ^= static_cast<uint64_t>(p[5]) << 40;  // fallthrough
+    case 5: h ^= static_cast<uint64_t>(p[4]) << 32;  // fallthrough
+    case 4: h ^= static_cast<uint64_t>(p[3]) << 24;  // fallthrough
+    case 3: h ^= static_cast<uint64_t>(p[2]) << 16;  // fallthrough
+    case 2: h ^= static_cast<uint64_t>(p[1]) << 8;   // fallthrough
+    case 1: h ^= static_cast<uint64_t>(p[0]);
+            h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+template <typename T>
+void AppendValue(const T& value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool IsEntryName(const char* name) {
+  if (strlen(name) != kEntryNameLength ||
+      strcmp(name + 16, kEntrySuffix) != 0) {
+    return false;
+  }
+  for (int i = 0; i < 16; ++i) {
+    if (!isxdigit(static_cast<unsigned char>(name[i]))) return false;
+  }
+  return true;
+}
+
+bool IsTmpName(const char* name) {
+  const size_t len = strlen(name);
+  const size_t suffix_len = sizeof(kTmpSuffix) - 1;
+  return (len > kEntryNameLength + suffix_len &&
+          IsEntryName(std::string(name, kEntryNameLength).c_str()) &&
+          strcmp(name + len - suffix_len, kTmpSuffix) == 0);
+}
+
+bool WriteAll(int fd, const std::string& data) {
+  size_t pos = 0;
+  while (pos < data.size()) {
+    ssize_t n = write(fd, data.data() + pos, data.size() - pos);
+    if (n < 0) return false;
+    pos += n;
+  }
+  return true;
+}
+
+}  // namespace
+
+ResultCache::ResultCache(const std::string& dir, size_t max_bytes)
+    : dir_(dir), max_bytes_(max_bytes), size_known_(false), size_(0) {}
+
+uint64_t ResultCache::Key(const Params& params, const std::string& in_data) {
+  return Key(params, in_data, std::string());
+}
+
+uint64_t ResultCache::Key(const Params& params, const std::string& in_data,
+                          const std::string& in_format) {
+  // num_threads does not change the output.
+  std::string fields;
+  AppendValue(kResultCacheVersion, &fields);
+  AppendValue(params.clear_metadata, &fields);
+  AppendValue(params.try_420, &fields);
+  AppendValue(params.force_420, &fields);
+  AppendValue(params.use_silver_screen, &fields);
+  AppendValue(params.zeroing_greedy_lookahead, &fields);
+  AppendValue(params.new_zeroing_model, &fields);
+  AppendValue(params.target_distance, &fields);
+  AppendValue(params.progressive, &fields);
+  AppendValue(static_cast<uint64_t>(params.target_bytes), &fields);
+  fields += in_format;
+  const uint64_t h = Hash64(in_data.data(), in_data.size(), 0);
+  return Hash64(fields.data(), fields.size(), h);
+}
+
+std::string ResultCache::EntryPath(uint64_t key) const {
+  char name[kEntryNameLength + 1];
+  snprintf(name, sizeof(name), "%016llx%s",
+           static_cast<unsigned long long>(key), kEntrySuffix);
+  return dir_ + "/" + name;
+}
+
+bool ResultCache::Lookup(uint64_t key, ProcessStats* stats,
+                         std::string* out_data) const {
+  const std::string path = EntryPath(key);
+  FILE* f = fopen(path.c_str(), "rb");
+  bool found = false;
+  if (f) {
+    std::string data;
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      data.append(buf, n);
+    }
+    // Anything but a complete jpeg file, from the SOI to the EOI marker, is
+    // treated as a miss and removed.
+    const size_t size = data.size();
+    const bool read_ok = !ferror(f);
+    found = (read_ok && size >= 4 &&
+             static_cast<uint8_t>(data[0]) == 0xff &&
+             static_cast<uint8_t>(data[1]) == 0xd8 &&
+             static_cast<uint8_t>(data[size - 2]) == 0xff &&
+             static_cast<uint8_t>(data[size - 1]) == 0xd9);
+    fclose(f);
+    if (found) {
+      out_data->swap(data);
+      // Mark the entry as recently used.
+      utimes(path.c_str(), nullptr);
+    } else if (read_ok) {
+      unlink(path.c_str());
+    }
+  }
+  if (stats) {
+    ++stats->counters[found ? kCacheHitsCnt : kCacheMissesCnt];
+    GUETZLI_LOG(stats, "Cache %s[%016llx]\n", found ? "hit" : "miss",
+                static_cast<unsigned long long>(key));
+  }
+  return found;
+}
+
+bool ResultCache::Store(uint64_t key, const std::string& out_data) {
+  static std::atomic<int> tmp_counter(0);
+  const std::string path = EntryPath(key);
+  char suffix[64];
+  snprintf(suffix, sizeof(suffix), ".%d.%d%s", static_cast<int>(getpid()),
+           tmp_counter++, kTmpSuffix);
+  const std::string tmp_path = path + suffix;
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = WriteAll(fd, out_data);
+  ok = (close(fd) == 0) && ok;
+  std::lock_guard<std::mutex> lock(mutex_);
+  // The size of the entry that the new one replaces, if any.
+  struct stat st;
+  const size_t old_size =
+      stat(path.c_str(), &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  size_ = size_ - std::min(size_, old_size) + out_data.size();
+  if (!size_known_ || size_ > max_bytes_) {
+    Evict();
+  }
+  return true;
+}
+
+void ResultCache::Evict() {
+  DIR* dir = opendir(dir_.c_str());
+  if (!dir) return;
+  const time_t now = time(nullptr);
+  // (modification time, size, path) of each entry.
+  std::vector<std::pair<time_t, std::pair<size_t, std::string> > > entries;
+  size_t total = 0;
+  while (struct dirent* ent = readdir(dir)) {
+    const bool is_tmp = IsTmpName(ent->d_name);
+    if (!is_tmp && !IsEntryName(ent->d_name)) continue;
+    const std::string path = dir_ + "/" + ent->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) continue;
+    if (is_tmp) {
+      if (now - st.st_mtime > kStaleTmpSeconds) {
+        unlink(path.c_str());
+      }
+      continue;
+    }
+    entries.push_back(std::make_pair(
+        st.st_mtime, std::make_pair(static_cast<size_t>(st.st_size), path)));
+    total += st.st_size;
+  }
+  closedir(dir);
+  if (total > max_bytes_) {
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size() && total > max_bytes_; ++i) {
+      if (unlink(entries[i].second.second.c_str()) == 0) {
+        total -= entries[i].second.first;
+      }
+    }
+  }
+  size_ = total;
+  size_known_ = true;
+}
+
+}  // namespace guetzli
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// An on-disk cache of compression results.
+
+#ifndef GUETZLI_RESULT_CACHE_H_
+#define GUETZLI_RESULT_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <string>
+
+#include "guetzli/processor.h"
+#include "guetzli/stats.h"
+
+namespace guetzli {
+
+// Bump this whenever Process() changes its output for the same input and
+// Params, so that stale entries are not found anymore.
+static const uint32_t kResultCacheVersion = 2;
+
+// Stores the output of Process() in a directory, one file per entry, named by
+// a 64-bit hash of the input bytes, the Params that affect the output and
+// kResultCacheVersion. Entries are written to a temporary file and renamed
+// into place, so concurrent readers and writers never see partial files. The
+// modification time of an entry is its last use; when the entries exceed the
+// size limit, the least recently used ones are removed. Store() may be called
+// from several threads at once.
+class ResultCache {
+ public:
+  // dir must exist.
+  ResultCache(const std::string& dir, size_t max_bytes);
+
+  static uint64_t Key(const Params& params, const std::string& in_data);
+  // Same as above, but also keyed by how in_data is to be read, e.g. the
+  // format and size of a headerless image. An empty in_format gives the same
+  // key as above.
+  static uint64_t Key(const Params& params, const std::string& in_data,
+                      const std::string& in_format);
+
+  // Sets *out_data to the entry of key and returns true if there is one.
+  // An entry that is not a complete jpeg file is removed and counts as a
+  // miss. Counts the hit or miss in stats, which may be null.
+  bool Lookup(uint64_t key, ProcessStats* stats, std::string* out_data) const;
+
+  // Adds out_data as the entry of key, then evicts entries if the cache has
+  // grown past its size limit.
+  bool Store(uint64_t key, const std::string& out_data);
+
+ private:
+  std::string EntryPath(uint64_t key) const;
+  // Scans the directory, removes the least recently used entries until the
+  // cache fits in its size limit and the temporary files left behind by
+  // crashed writers, and sets size_ to the size of the remaining entries.
+  void Evict();
+
+  const std::string dir_;
+  const size_t max_bytes_;
+  // Guards the fields below.
+  std::mutex mutex_;
+  // Whether size_ has been set by a scan yet.
+  bool size_known_;
+  // The size of the entries at the last scan plus the entries stored since.
+  // Entries replaced or added by other processes are only accounted for by
+  // the next scan.
+  size_t size_;
+};
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_RESULT_CACHE_H_
@@ -0,0 +1,256 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "guetzli/ssim_comparator.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "guetzli/gamma_correct.h"
+#include "guetzli/thread_pool.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
+
+namespace guetzli {
+
+namespace {
+
+static const int kNumScales = 3;
+static const float kScaleWeights[kNumScales] = { 0.5f, 0.3f, 0.2f };
+static const float kChannelWeights[3] = { 0.25f, 0.5f, 0.25f };
+
+// Returns 1 - SSIM of the window of xsize x ysize values at (x0, y0) of the
+// original and distorted planes a and b with the given stride.
+float WindowDistance(const float* a, const float* b, int stride,
+                     int x0, int y0, int xsize, int ysize) {
+  float sa = 0.0f, sb = 0.0f, saa = 0.0f, sbb = 0.0f, sab = 0.0f;
+  int x_begin = 0;
+#ifdef __SSE2__
+  if (xsize == 8) {
+    __m128 vsa = _mm_setzero_ps();
+    __m128 vsb = _mm_setzero_ps();
+    __m128 vsaa = _mm_setzero_ps();
+    __m128 vsbb = _mm_setzero_ps();
+    __m128 vsab = _mm_setzero_ps();
+    for (int y = 0; y < ysize; ++y) {
+      const float* row_a = &a[(y0 + y) * stride + x0];
+      const float* row_b = &b[(y0 + y) * stride + x0];
+      for (int x = 0; x < 8; x += 4) {
+        const __m128 va = _mm_loadu_ps(row_a + x);
+        const __m128 vb = _mm_loadu_ps(row_b + x);
+        vsa = _mm_add_ps(vsa, va);
+        vsb = _mm_add_ps(vsb, vb);
+        vsaa = _mm_add_ps(vsaa, _mm_mul_ps(va, va));
+        vsbb = _mm_add_ps(vsbb, _mm_mul_ps(vb, vb));
+        vsab = _mm_add_ps(vsab, _mm_mul_ps(va, vb));
+      }
+    }
+    float buf[5][4];
+    _mm_storeu_ps(buf[0], vsa);
+    _mm_storeu_ps(buf[1], vsb);
+    _mm_storeu_ps(buf[2], vsaa);
+    _mm_storeu_ps(buf[3], vsbb);
+    _mm_storeu_ps(buf[4], vsab);
+    sa = buf[0][0] + buf[0][1] + buf[0][2] + buf[0][3];
+    sb = buf[1][0] + buf[1][1] + buf[1][2] + buf[1][3];
+    saa = buf[2][0] + buf[2][1] + buf[2][2] + buf[2][3];
+    sbb = buf[3][0] + buf[3][1] + buf[3][2] + buf[3][3];
+    sab = buf[4][0] + buf[4][1] + buf[4][2] + buf[4][3];
+    x_begin = 8;
+  }
+#endif  // __SSE2__
+  for (int y = 0; y < ysize; ++y) {
+    const float* row_a = &a[(y0 + y) * stride + x0];
+    const float* row_b = &b[(y0 + y) * stride + x0];
+    for (int x = x_begin; x < xsize; ++x) {
+      sa += row_a[x];
+      sb += row_b[x];
+      saa += row_a[x] * row_a[x];
+      sbb += row_b[x] * row_b[x];
+      sab += row_a[x] * row_b[x];
+    }
+  }
+  const float inv_n = 1.0f / (xsize * ysize);
+  const float mu_a = sa * inv_n;
+  const float mu_b = sb * inv_n;
+  const float var_a = std::max(0.0f, saa * inv_n - mu_a * mu_a);
+  const float var_b = std::max(0.0f, sbb * inv_n - mu_b * mu_b);
+  const float cov = sab * inv_n - mu_a * mu_b;
+  const float ssim = ((2 * mu_a * mu_b + kSSIMC1) * (2 * cov + kSSIMC2)) /
+      ((mu_a * mu_a + mu_b * mu_b + kSSIMC1) * (var_a + var_b + kSSIMC2));
+  return std::max(0.0f, 1.0f - ssim);
+}
+
+// Halves the xsize x ysize plane in place, averaging 2x2 pixels. The last
+// row and column are duplicated for odd sizes.
+void Downsample2x(float* plane, int stride, int xsize, int ysize) {
+  for (int y = 0; y < (ysize + 1) / 2; ++y) {
+    const float* row0 = &plane[2 * y * stride];
+    const float* row1 = &plane[std::min(2 * y + 1, ysize - 1) * stride];
+    float* out = &plane[y * stride];
+    for (int x = 0; x < (xsize + 1) / 2; ++x) {
+      const int x1 = std::min(2 * x + 1, xsize - 1);
+      out[x] = 0.25f * (row0[2 * x] + row0[x1] + row1[2 * x] + row1[x1]);
+    }
+  }
+}
+
+}  // namespace
+
+SSIMComparator::SSIMComparator(int w, int h, ThreadPool* pool)
+    : width_(w),
+      height_(h),
+      width_in_blocks_((w + 7) / 8),
+      height_in_blocks_((h + 7) / 8),
+      width_in_tiles_((w + kTileSize - 1) / kTileSize),
+      height_in_tiles_((h + kTileSize - 1) / kTileSize),
+      pool_(pool),
+      distmap_(width_in_blocks_ * height_in_blocks_),
+      tile_sums_(width_in_tiles_ * height_in_tiles_),
+      distance_(0.0),
+      compared_(false),
+      tile_is_dirty_(tile_sums_.size()) {}
+
+SSIMComparator::SSIMComparator(const std::vector<uint8_t>& rgb, int w, int h,
+                               ThreadPool* pool)
+    : SSIMComparator(w, h, pool) {
+  const float* lut = Srgb8ToLinearFloatTable();
+  std::shared_ptr<std::vector<float> > linear =
+      std::make_shared<std::vector<float> >(3 * w * h);
+  for (int c = 0; c < 3; ++c) {
+    float* plane = &(*linear)[c * w * h];
+    for (int i = 0; i < w * h; ++i) {
+      plane[i] = lut[rgb[3 * i + c]];
+    }
+  }
+  linear_ = linear;
+}
+
+SSIMComparator::SSIMComparator(const SSIMComparator& other, ThreadPool* pool)
+    : SSIMComparator(other.width_, other.height_, pool) {
+  linear_ = other.linear_;
+}
+
+void SSIMComparator::CompareTile(const OutputImage& img, int tile_idx) {
+  const int tile_x = tile_idx % width_in_tiles_;
+  const int tile_y = tile_idx / width_in_tiles_;
+  const int x0 = tile_x * kTileSize;
+  const int y0 = tile_y * kTileSize;
+  const int xsize = std::min(kTileSize, width_ - x0);
+  const int ysize = std::min(kTileSize, height_ - y0);
+  const int xsize_blocks = (xsize + 7) / 8;
+  const int ysize_blocks = (ysize + 7) / 8;
+
+  const float* lut = Srgb8ToLinearFloatTable();
+  const std::vector<uint8_t> srgb = img.ToSRGB(x0, y0, xsize, ysize);
+  float block_dist[kTileSize / 8][kTileSize / 8] = { { 0.0f } };
+  float a[kTileSize * kTileSize];
+  float b[kTileSize * kTileSize];
+  for (int c = 0; c < 3; ++c) {
+    for (int y = 0; y < ysize; ++y) {
+      const float* row = &(*linear_)[(c * height_ + y0 + y) * width_ + x0];
+      std::copy(row, row + xsize, &a[y * kTileSize]);
+      for (int x = 0; x < xsize; ++x) {
+        b[y * kTileSize + x] = lut[srgb[3 * (y * xsize + x) + c]];
+      }
+    }
+    int w = xsize;
+    int h = ysize;
+    for (int scale = 0; scale < kNumScales; ++scale) {
+      const float weight = kChannelWeights[c] * kScaleWeights[scale];
+      for (int wy = 0; wy < (h + 7) / 8; ++wy) {
+        for (int wx = 0; wx < (w + 7) / 8; ++wx) {
+          const float d = weight * WindowDistance(
+              a, b, kTileSize, 8 * wx, 8 * wy,
+              std::min(8, w - 8 * wx), std::min(8, h - 8 * wy));
+          // The window covers 2^scale x 2^scale blocks of the full image.
+          const int by_end = std::min(ysize_blocks, (wy + 1) << scale);
+          const int bx_end = std::min(xsize_blocks, (wx + 1) << scale);
+          for (int by = wy << scale; by < by_end; ++by) {
+            for (int bx = wx << scale; bx < bx_end; ++bx) {
+              block_dist[by][bx] += d;
+            }
+          }
+        }
+      }
+      if (scale + 1 < kNumScales) {
+        Downsample2x(a, kTileSize, w, h);
+        Downsample2x(b, kTileSize, w, h);
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+      }
+    }
+  }
+  double sum = 0.0;
+  for (int by = 0; by < ysize_blocks; ++by) {
+    for (int bx = 0; bx < xsize_blocks; ++bx) {
+      const float d = block_dist[by][bx];
+      const int block_idx = (y0 / 8 + by) * width_in_blocks_ + x0 / 8 + bx;
+      distmap_[block_idx] = d;
+      sum += static_cast<double>(d) * d * d;
+    }
+  }
+  tile_sums_[tile_idx] = sum;
+}
+
+void SSIMComparator::UpdateDistance() {
+  double sum = 0.0;
+  for (double tile_sum : tile_sums_) {
+    sum += tile_sum;
+  }
+  distance_ = std::cbrt(sum / distmap_.size());
+}
+
+void SSIMComparator::Compare(const OutputImage& img) {
+  ParallelFor(pool_, tile_sums_.size(), [this, &img](int tile_idx) {
+    CompareTile(img, tile_idx);
+  });
+  UpdateDistance();
+  compared_ = true;
+}
+
+void SSIMComparator::CompareDirty(OutputImage* img) {
+  if (!compared_) {
+    Compare(*img);
+    img->ClearDirtyBlocks();
+    return;
+  }
+  const int tile_blocks = kTileSize / 8;
+  dirty_tiles_.clear();
+  for (int block_idx : img->DirtyBlocks()) {
+    const int block_x = block_idx % width_in_blocks_;
+    const int block_y = block_idx / width_in_blocks_;
+    const int tile_idx = ((block_y / tile_blocks) * width_in_tiles_ +
+                          block_x / tile_blocks);
+    if (!tile_is_dirty_[tile_idx]) {
+      tile_is_dirty_[tile_idx] = 1;
+      dirty_tiles_.push_back(tile_idx);
+    }
+  }
+  img->ClearDirtyBlocks();
+  if (dirty_tiles_.empty()) return;
+  ParallelFor(pool_, dirty_tiles_.size(), [this, img](int i) {
+    CompareTile(*img, dirty_tiles_[i]);
+  });
+  for (int tile_idx : dirty_tiles_) {
+    tile_is_dirty_[tile_idx] = 0;
+  }
+  UpdateDistance();
+}
+
+}  // namespace guetzli
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A fast perceptual distance based on block SSIM.
+
+#ifndef GUETZLI_SSIM_COMPARATOR_H_
+#define GUETZLI_SSIM_COMPARATOR_H_
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "guetzli/comparator.h"
+#include "guetzli/output_image.h"
+
+namespace guetzli {
+
+class ThreadPool;
+
+// The usual SSIM stabilizing constants, for values in range 0-255.
+static const float kSSIMC1 = (0.01f * 255) * (0.01f * 255);
+static const float kSSIMC2 = (0.03f * 255) * (0.03f * 255);
+
+// Multi-scale structural similarity of the linear RGB channels, with the
+// statistics computed over non-overlapping 8x8 windows at 1x, 2x and 4x
+// downsampling. The distance of an 8x8 block of the image is the weighted sum
+// of 1 - SSIM of the windows that cover it, and the distance of the image is
+// the 3-norm of the block distances.
+//
+// The image is split into independent 32x32 tiles, which are compared in
+// parallel when a thread pool is given. CompareDirty() only recomputes the
+// tiles that contain dirty blocks.
+class SSIMComparator : public Comparator {
+ public:
+  // rgb is the original image, in 8-bit sRGB. pool may be null.
+  SSIMComparator(const std::vector<uint8_t>& rgb, int w, int h,
+                 ThreadPool* pool);
+  // Compares against the same original image as other, sharing its linear RGB
+  // planes, so that several images can be compared to it concurrently.
+  SSIMComparator(const SSIMComparator& other, ThreadPool* pool);
+
+  void Compare(const OutputImage& img) override;
+  void CompareDirty(OutputImage* img) override;
+  double distance() const override { return distance_; }
+  const std::vector<float>& distmap() const override { return distmap_; }
+
+  static const int kTileSize = 32;
+
+ private:
+  SSIMComparator(int w, int h, ThreadPool* pool);
+
+  // Updates the distmap and the distance sum of tile tile_idx.
+  void CompareTile(const OutputImage& img, int tile_idx);
+  void UpdateDistance();
+
+  const int width_;
+  const int height_;
+  const int width_in_blocks_;
+  const int height_in_blocks_;
+  const int width_in_tiles_;
+  const int height_in_tiles_;
+  ThreadPool* pool_;
+  // The linear RGB planes of the original image, one after the other.
+  std::shared_ptr<const std::vector<float> > linear_;
+  std::vector<float> distmap_;
+  // The sum of the cubed block distances of each tile.
+  std::vector<double> tile_sums_;
+  double distance_;
+  bool compared_;
+  // Scratch space of CompareDirty().
+  std::vector<uint8_t> tile_is_dirty_;
+  std::vector<int> dirty_tiles_;
+};
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_SSIM_COMPARATOR_H_
@@ -29,6 +29,16 @@ namespace guetzli {
 static const char* const  kNumItersCnt = "number of iterations";
 static const char* const kNumItersUpCnt = "number of iterations up";
 static const char* const kNumItersDownCnt = "number of iterations down";
+static const char* const kInputSizeCnt = "input size";
+static const char* const kOutputSizeCnt = "output size";
+static const char* const kTargetSizeTrialsCnt = "number of target size trials";
+static const char* const kTargetSizeQualityCnt = "target size quality";
+static const char* const k444SizeCnt = "YUV444 candidate size";
+static const char* const k420SizeCnt = "YUV420 candidate size";
+static const char* const k444TimeCnt = "YUV444 candidate time (ms)";
+static const char* const k420TimeCnt = "YUV420 candidate time (ms)";
+static const char* const kCacheHitsCnt = "cache hits";
+static const char* const kCacheMissesCnt = "cache misses";
 
 struct ProcessStats {
   ProcessStats() {}
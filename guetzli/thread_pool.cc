@@ -0,0 +1,139 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "guetzli/thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace guetzli {
+
+ThreadPool::ThreadPool(int num_threads)
+    : num_threads_(std::max(1, num_threads)) {
+  if (num_threads <= 1) return;
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+int ThreadPool::DefaultNumThreads() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void ThreadPool::Schedule(std::function<void()> task) {
+  if (workers_.empty()) {
+    task();
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    ++num_pending_;
+  }
+  work_cv_.notify_one();
+}
+
+void ThreadPool::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return num_pending_ == 0; });
+}
+
+void ThreadPool::WorkerLoop() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (--num_pending_ == 0) done_cv_.notify_all();
+    }
+  }
+}
+
+namespace {
+
+// Shared between the threads of one ParallelFor() call. The helper tasks may
+// start after the call has returned, so this is reference counted.
+struct ParallelForState {
+  ParallelForState(int n, const std::function<void(int)>& fn)
+      : n(n), fn(fn), next(0), num_done(0) {}
+
+  // Runs iterations until there are none left.
+  void Run() {
+    int num_run = 0;
+    for (int i; (i = next++) < n; ++num_run) {
+      fn(i);
+    }
+    if (num_run > 0) {
+      std::unique_lock<std::mutex> lock(mutex);
+      num_done += num_run;
+      if (num_done == n) done_cv.notify_all();
+    }
+  }
+
+  const int n;
+  const std::function<void(int)> fn;
+  std::atomic<int> next;
+  int num_done;
+  std::mutex mutex;
+  std::condition_variable done_cv;
+};
+
+}  // namespace
+
+void ThreadPool::ParallelFor(int n, const std::function<void(int)>& fn) {
+  if (workers_.empty() || n <= 1) {
+    for (int i = 0; i < n; ++i) fn(i);
+    return;
+  }
+  std::shared_ptr<ParallelForState> state =
+      std::make_shared<ParallelForState>(n, fn);
+  const int num_helpers = std::min(n, num_threads_) - 1;
+  for (int i = 0; i < num_helpers; ++i) {
+    Schedule([state] { state->Run(); });
+  }
+  state->Run();
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->done_cv.wait(lock, [&state] { return state->num_done == state->n; });
+}
+
+void ParallelFor(ThreadPool* pool, int n, const std::function<void(int)>& fn) {
+  if (pool == nullptr) {
+    for (int i = 0; i < n; ++i) fn(i);
+  } else {
+    pool->ParallelFor(n, fn);
+  }
+}
+
+}  // namespace guetzli
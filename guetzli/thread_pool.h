@@ -0,0 +1,78 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A simple pool of worker threads.
+
+#ifndef GUETZLI_THREAD_POOL_H_
+#define GUETZLI_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace guetzli {
+
+class ThreadPool {
+ public:
+  // Starts num_threads worker threads. If num_threads <= 1, no threads are
+  // started and all work runs on the calling thread.
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Returns the number of threads that work can run on, at least 1.
+  int num_threads() const { return num_threads_; }
+
+  // Queues task to run on one of the worker threads, or runs it right away if
+  // the pool has no worker threads.
+  void Schedule(std::function<void()> task);
+
+  // Waits until all scheduled tasks have finished.
+  void Wait();
+
+  // Calls fn(i) for each i in [0, n) and returns when all calls have
+  // finished. The calling thread takes part in the work, so this may also be
+  // used from inside a task.
+  void ParallelFor(int n, const std::function<void(int)>& fn);
+
+  // Returns the number of hardware threads, at least 1.
+  static int DefaultNumThreads();
+
+ private:
+  void WorkerLoop();
+
+  const int num_threads_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::deque<std::function<void()> > tasks_;
+  int num_pending_ = 0;
+  bool stop_ = false;
+};
+
+// Calls fn(i) for each i in [0, n), on pool if it is not null, otherwise on
+// the calling thread.
+void ParallelFor(ThreadPool* pool, int n, const std::function<void(int)>& fn);
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_THREAD_POOL_H_
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "guetzli/upsample.h"
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
+
+namespace guetzli {
+
+namespace {
+
+// Returns 3 * near[i] + far[i], the vertical part of the filter.
+inline int VerticalSum(const uint8_t* near, const uint8_t* far, int i) {
+  return 3 * near[i] + far[i];
+}
+
+inline void FancyUpsampleScalar(const uint8_t* near, const uint8_t* far,
+                                int sub_width, int xmin, int xmax,
+                                uint16_t* out) {
+  for (int x = xmin; x < xmax; ++x) {
+    const int i = x >> 1;
+    const int i1 = std::min(sub_width - 1, std::max(0, i + 2 * (x & 1) - 1));
+    out[x] = 3 * VerticalSum(near, far, i) + VerticalSum(near, far, i1);
+  }
+}
+
+#ifdef __SSE2__
+
+// Returns 3 * near[i..i+7] + far[i..i+7] as 16-bit values.
+inline __m128i VerticalSum8(const uint8_t* near, const uint8_t* far) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i n = _mm_unpacklo_epi8(
+      _mm_loadl_epi64(reinterpret_cast<const __m128i*>(near)), zero);
+  const __m128i f = _mm_unpacklo_epi8(
+      _mm_loadl_epi64(reinterpret_cast<const __m128i*>(far)), zero);
+  return _mm_add_epi16(_mm_add_epi16(n, _mm_add_epi16(n, n)), f);
+}
+
+#endif  // __SSE2__
+
+}  // namespace
+
+void FancyUpsampleRow(const uint8_t* near, const uint8_t* far, int sub_width,
+                      int width, uint16_t* out) {
+  int x = 0;
+#ifdef __SSE2__
+  // Each iteration computes the output pixels 2 * i ... 2 * i + 15 from the
+  // subsampled pixels i - 1 ... i + 8, so the first output pair and the end
+  // of the row, where the edge pixels are duplicated, are left to the scalar
+  // code below.
+  FancyUpsampleScalar(near, far, sub_width, 0, std::min(2, width), out);
+  x = 2;
+  for (int i = 1; i + 9 <= sub_width && 2 * i + 16 <= width; i += 8) {
+    const __m128i left = VerticalSum8(near + i - 1, far + i - 1);
+    const __m128i center = VerticalSum8(near + i, far + i);
+    const __m128i right = VerticalSum8(near + i + 1, far + i + 1);
+    const __m128i center3 =
+        _mm_add_epi16(center, _mm_add_epi16(center, center));
+    const __m128i even = _mm_add_epi16(center3, left);
+    const __m128i odd = _mm_add_epi16(center3, right);
+    __m128i* dst = reinterpret_cast<__m128i*>(out + 2 * i);
+    _mm_storeu_si128(dst, _mm_unpacklo_epi16(even, odd));
+    _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(even, odd));
+    x = 2 * i + 16;
+  }
+#endif  // __SSE2__
+  FancyUpsampleScalar(near, far, sub_width, x, width, out);
+}
+
+void RoundUpsampledRow(const uint16_t* in, int width, uint8_t* out) {
+  for (int x = 0; x < width; ++x) {
+    out[x] = (in[x] + 8 - (x & 1)) >> 4;
+  }
+}
+
+}  // namespace guetzli
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The "fancy upsampling" filter used for 2x2 subsampled image components.
+
+#ifndef GUETZLI_UPSAMPLE_H_
+#define GUETZLI_UPSAMPLE_H_
+
+#include <stdint.h>
+
+namespace guetzli {
+
+// Computes one row of the 2x2 "fancy upsampling" of a subsampled component,
+// i.e. the 9/3/3/1 weighted sum of the nearest four subsampled pixels, scaled
+// by 16 and without rounding. 'near' is the subsampled row that contains the
+// output row, 'far' is the subsampled row above it (for even output rows) or
+// below it (for odd output rows). Both rows have 'sub_width' pixels, which are
+// duplicated at the edges. Writes 'width' values to out, where
+// width <= 2 * sub_width.
+void FancyUpsampleRow(const uint8_t* near, const uint8_t* far, int sub_width,
+                      int width, uint16_t* out);
+
+// Rounds the output of FancyUpsampleRow() to 8-bit pixels, with the
+// alternating bias that libjpeg uses.
+void RoundUpsampledRow(const uint16_t* in, int width, uint8_t* out);
+
+}  // namespace guetzli
+
+#endif  // GUETZLI_UPSAMPLE_H_
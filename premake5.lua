@@ -15,6 +15,8 @@ workspace "guetzli"
   -- workaround for #41
   filter "action:gmake"
     symbols "On"
+    buildoptions { "-pthread" }
+    linkoptions { "-pthread" }
 
   filter "configurations:Debug"
     symbols "On"
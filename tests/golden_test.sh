@@ -22,7 +22,7 @@ done
 
 for i in $INPUT_DIR_PNG/*.png $INPUT_DIR_JPG/*.jpg; do
   echo $i $OUTPUT_DIR/$(basename $i).guetzli.jpg
-done | xargs -L 1 -P $(getconf _NPROCESSORS_ONLN) -t $GUETZLI
+done | $GUETZLI --batch - --jobs $(getconf _NPROCESSORS_ONLN) || exit 1
 
 if [[ -n "$UPDATE_GOLDEN" ]]; then
   (cd $OUTPUT_DIR ; sha256sum *) > $(dirname $0)/golden_checksums.txt
@@ -3,18 +3,27 @@
 GUETZLI=${1:-bin/Release/guetzli}
 BEES_PNG=$(dirname $0)/bees.png
 BEES_JPG=$(mktemp ${TMPDIR:-/tmp}/beesXXXX.jpg)
+BEES_PPM=$(mktemp ${TMPDIR:-/tmp}/beesXXXX.ppm)
+BEES_PGM=$(mktemp ${TMPDIR:-/tmp}/beesXXXX.pgm)
 BUTTERAUGLI=$2
+# Wide and detailed enough for a single block row to exceed the output buffer.
+NOISE_PPM=$(mktemp ${TMPDIR:-/tmp}/noiseXXXX.ppm)
 
+pngtopnm < $BEES_PNG > $BEES_PPM || exit 2
+ppmtopgm < $BEES_PPM > $BEES_PGM || exit 2
 pngtopnm < $BEES_PNG | cjpeg -sample 1x1 -quality 100 > $BEES_JPG || exit 2
+{ printf 'P6\n30000 8\n255\n'; head -c 720000 /dev/urandom; } > $NOISE_PPM || exit 2
 
 function run_test() {
-  # png/jpeg stdin/file stdout/file flags...
+  # png/jpeg/gray/noise stdin/file stdout/file flags...
   local in=
   local out=$(mktemp ${TMPDIR:-/tmp}/beesXXX.guetzli.jpg)
   echo "Testing $@, output in $out"
   case "$1" in
     png) in=$BEES_PNG ;;
     jpeg) in=$BEES_JPG ;;
+    gray) in=$BEES_PGM ;;
+    noise) in=$NOISE_PPM ;;
     *) exit 2 ;;
   esac
   shift
@@ -48,6 +57,38 @@ run_test png file stdout --verbose
 run_test png file stdout --nomemlimit
 run_test png file stdout --memlimit 100
 run_test png file stdout --quality 85
+run_test png file file --progressive
+run_test png file file --try420
+run_test gray file file --try420
+run_test noise file file --progressive
+run_test noise file file --progressive --target-bytes 100000000
+
+function run_psnr_test() {
+  # input min_psnr flags...
+  # Compresses a version of bees.png and checks the luma PSNR of the decoded
+  # output against bees.png.
+  local in=$1
+  local min_psnr=$2
+  shift; shift
+  local out=$(mktemp ${TMPDIR:-/tmp}/beesXXX.guetzli.jpg)
+  local decoded=$(mktemp ${TMPDIR:-/tmp}/beesXXX.guetzli.ppm)
+  echo "Testing PSNR >= $min_psnr with $in $@, output in $out"
+  $GUETZLI $@ $in $out || { echo "Compression failed"; exit 1; }
+  djpeg < $out > $decoded || { echo "$out is not a valid JPEG"; exit 1; }
+  local psnr=$(pnmpsnr -machine $BEES_PPM $decoded | awk '{ print $1 }')
+  echo "PSNR $psnr"
+  awk -v psnr=$psnr -v min=$min_psnr \
+      'BEGIN { exit !(psnr == "inf" || psnr + 0 >= min + 0) }' ||
+      { echo "PSNR of $out is too low"; exit 1; }
+  rm $out $decoded
+  echo "OK"
+}
+
+# Outputs with quantization tables other than all 1s.
+run_psnr_test $BEES_PNG 32 --target-bytes 20000
+run_psnr_test $BEES_PNG 30 --target-bytes 10000
+run_psnr_test $BEES_PPM 32 --target-bytes 20000 --progressive
+run_psnr_test $BEES_JPG 32 --target-bytes 20000
 
 echo $GUETZLI /dev/null /dev/null
 $GUETZLI /dev/null /dev/null